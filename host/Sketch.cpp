@@ -0,0 +1,8 @@
+/*
+ * Sketch
+ * The Arduino sketch built as an ordinary translation unit for the host
+ *
+ * @author Steinar Thorshaug
+ */
+#include <Arduino.h>
+#include "esp8266-controller.ino"
@@ -0,0 +1,327 @@
+/*
+ * ControllerBench
+ * Micro benchmarks of the controller core, run on the host build.
+ * Prints one JSON object per benchmark and line. With --baseline the
+ * results are compared against an earlier run and the exit code is 1 if
+ * any benchmark got slower than the tolerance, 15 % by default.
+ *
+ * @author Steinar Thorshaug
+ */
+#include <chrono>
+#include <vector>
+#include <string>
+#include <map>
+#include <algorithm>
+#include "HostHal.h"
+#include "MessageHandler.h"
+#include "IOHandler.h"
+#include "Scheduler.h"
+#include "JsonWriter.h"
+#include "BinaryProtocol.h"
+#include "Log.h"
+
+// From the sketch
+void setup();
+void loop();
+extern const char *MQTT_TOPIC_SUBSCRIBE;
+
+typedef std::chrono::steady_clock BenchClock;
+
+struct BenchResult {
+  std::string   name;
+  unsigned long ops;
+  double        nsPerOp;
+  std::string   extra;   // More JSON fields, starting with a comma
+};
+
+const int BENCH_RUNS = 5; // Runs of each micro benchmark
+
+static bool quick = false;
+static unsigned long published = 0;
+static std::vector<BenchResult> results;
+
+/**
+ * Count the messages published by the device
+ */
+static void countPublish(const char*, const uint8_t*, unsigned int) {
+  published++;
+}
+
+/**
+ * Nanoseconds since a start time
+ */
+static double elapsedNs(BenchClock::time_point started) {
+  return std::chrono::duration<double, std::nano>(BenchClock::now() - started).count();
+}
+
+/**
+ * Iterations of a benchmark, fewer with --quick
+ */
+static unsigned long iterations(unsigned long full) {
+  return quick ? full / 100 : full;
+}
+
+/**
+ * Keep a result for printing
+ * A benchmark run several times keeps its fastest run, the one least
+ * disturbed by the rest of the host.
+ */
+static void addResult(const char *name, unsigned long ops, double totalNs, const std::string &extra = "") {
+  BenchResult result;
+  result.name = name;
+  result.ops = ops;
+  result.nsPerOp = ops ? totalNs / ops : 0;
+  result.extra = extra;
+  for(size_t i=0; i<results.size(); i++) {
+    if(results[i].name == result.name) {
+      if(result.nsPerOp < results[i].nsPerOp) {
+        results[i] = result;
+      }
+      return;
+    }
+  }
+  results.push_back(result);
+}
+
+/**
+ * Text requests decoded and queued
+ * All are reads of one pin, so after the first they are merged into the
+ * queued read and the queue never fills.
+ */
+static void benchParseText(MessageHandler *handler) {
+  static const char *payloads[] = { "ReadValues;4;100", "ReadValues;4;2500", "ReadValues;4;0\n", "ReadValues;4;32767" };
+  const unsigned long count = iterations(2000000);
+  char topic[] = "bench/control";
+  BenchClock::time_point started = BenchClock::now();
+  for(unsigned long i=0; i<count; i++) {
+    const char *payload = payloads[i & 3];
+    handler->handleRequest(topic, (byte*)payload, strlen(payload));
+  }
+  addResult("parse_text", count, elapsedNs(started));
+}
+
+/**
+ * Binary requests decoded and queued
+ */
+static void benchParseBinary(MessageHandler *handler) {
+  byte frame[BINARY_REQUEST_SIZE] = { BINARY_MAGIC, MessageHandler::REQ_ReadValues, 4, 100, 0 };
+  const unsigned long count = iterations(2000000);
+  char topic[] = "bench/control";
+  BenchClock::time_point started = BenchClock::now();
+  for(unsigned long i=0; i<count; i++) {
+    handler->handleRequest(topic, frame, sizeof(frame));
+  }
+  addResult("parse_binary", count, elapsedNs(started));
+}
+
+/**
+ * A response with two values formatted as JSON
+ */
+static void benchFormatResponse() {
+  char buffer[151];
+  JsonWriter json(buffer, sizeof(buffer));
+  const unsigned long count = iterations(2000000);
+  unsigned long length = 0;
+  BenchClock::time_point started = BenchClock::now();
+  for(unsigned long i=0; i<count; i++) {
+    json.reset();
+    json.beginObject();
+    json.addUnsigned("time", 1700000000UL + i);
+    json.addInt("req", MessageHandler::REQ_ReadValues);
+    json.addBool("status", true);
+    json.addString("message", "");
+    json.addFixed("temp", 215 + (long)(i & 63), 1);
+    json.addFixed("hum", 402, 1);
+    json.endObject();
+    length += json.length();
+  }
+  addResult("format_response", count, elapsedNs(started), ",\"bytes\":" + std::to_string(length / max(count, 1UL)));
+}
+
+/**
+ * A decoded request run and answered, including the publish
+ */
+static void benchHandleRequest(MessageHandler *handler) {
+  MessageHandler::MyRequest req;
+  req.req = MessageHandler::REQ_ToggleOnOff;
+  req.pin = 4;
+  req.waittime = 50;
+  req.encoding = MessageHandler::ENCODING_Text;
+  req.scheduled = false;
+  req.argCount = 0;
+  const unsigned long count = iterations(500000);
+  published = 0;
+  BenchClock::time_point started = BenchClock::now();
+  for(unsigned long i=0; i<count; i++) {
+    handler->handleRequest(&req);
+    logLoop();
+  }
+  addResult("handle_request", count, elapsedNs(started), ",\"published\":" + std::to_string(published));
+}
+
+/**
+ * Scheduler ticks with N jobs, one tick per virtual ms
+ * The firmware has MAX_SCHEDULES slots, the larger sizes show how the
+ * tick cost grows with the number of jobs.
+ */
+template <int N>
+static void benchSchedulerTick(const char *name) {
+  SchedulerT<N> scheduler;
+  for(int i=0; i<N; i++) {
+    scheduler.add(10 + 7 * i);
+  }
+  const unsigned long count = iterations(5000000);
+  const unsigned long start = millis();
+  unsigned long due = 0;
+  BenchClock::time_point started = BenchClock::now();
+  for(unsigned long now=start; now-start<count; now++) {
+    while(scheduler.popDue(now) >= 0) {
+      due++;
+    }
+  }
+  addResult(name, count, elapsedNs(started), ",\"due\":" + std::to_string(due));
+}
+
+/**
+ * Nearest rank percentile of sorted samples
+ */
+static double percentile(const std::vector<double> &sorted, double p) {
+  if(sorted.empty()) {
+    return 0;
+  }
+  size_t rank = (size_t)(p / 100 * (sorted.size() - 1) + 0.5);
+  return sorted[rank];
+}
+
+/**
+ * Main loop of the sketch while commands arrive at a fixed rate
+ * A mix of pulses, reads that fail fast and invalid requests, spread over
+ * the virtual time. Each loop() call is timed on the host.
+ */
+static void benchLoopFlood() {
+  static const char *commands[] = { "ToggleOnOff;4;20", "ReadValues;4;0", "ToggleOnOff;4;5", "Unknown;4;0" };
+  const unsigned long rate = 500;                 // Commands per virtual second
+  const uint64_t duration = quick ? 1000000 : 20000000; // Virtual us
+  std::vector<double> samples;
+
+  setup();
+  // Connect before the flood starts
+  while(hostMicros() < 3000000) {
+    loop();
+  }
+
+  uint64_t start = hostMicros();
+  uint64_t period = 1000000 / rate;
+  unsigned long sent = 0;
+  uint64_t nextCommand = start;
+  published = 0;
+  while(hostMicros() - start < duration) {
+    // Keep the delivery queue topped up a little ahead of the clock
+    while(nextCommand < start + duration && hostDeliveryPending() < 64) {
+      const char *command = commands[sent & 3];
+      hostDeliver(MQTT_TOPIC_SUBSCRIBE, (const uint8_t*)command, strlen(command), nextCommand);
+      nextCommand += period;
+      sent++;
+    }
+    BenchClock::time_point started = BenchClock::now();
+    loop();
+    samples.push_back(elapsedNs(started));
+  }
+  std::vector<double> sorted = samples;
+  std::sort(sorted.begin(), sorted.end());
+  double total = 0;
+  for(size_t i=0; i<samples.size(); i++) {
+    total += samples[i];
+  }
+  char extra[200];
+  snprintf(extra, sizeof(extra), ",\"mean_ns\":%.0f,\"p99_ns\":%.0f,\"max_ns\":%.0f,\"commands\":%lu,\"published\":%lu",
+    samples.empty() ? 0 : total / samples.size(), percentile(sorted, 99), sorted.empty() ? 0 : sorted.back(), sent, published);
+  // ns_per_op is the median loop, the mean is skewed by host scheduling
+  addResult("loop_flood", samples.size(), percentile(sorted, 50) * samples.size(), extra);
+}
+
+/**
+ * Read ns_per_op of each benchmark from an earlier run
+ */
+static bool readBaseline(const char *path, std::map<std::string, double> *baseline) {
+  FILE *file = fopen(path, "r");
+  if(!file) {
+    return false;
+  }
+  char line[512];
+  while(fgets(line, sizeof(line), file)) {
+    char name[64];
+    const char *ns = strstr(line, "\"ns_per_op\":");
+    if(sscanf(line, "{\"bench\":\"%63[^\"]\"", name) == 1 && ns) {
+      (*baseline)[name] = atof(ns + strlen("\"ns_per_op\":"));
+    }
+  }
+  fclose(file);
+  return true;
+}
+
+/**
+ * Print the results, compared against the baseline if there is one
+ * Returns false if a benchmark is slower than the tolerance allows
+ */
+static bool printResults(const std::map<std::string, double> &baseline, double tolerance) {
+  bool ok = true;
+  for(size_t i=0; i<results.size(); i++) {
+    const BenchResult *r = &results[i];
+    printf("{\"bench\":\"%s\",\"ops\":%lu,\"ns_per_op\":%.1f%s", r->name.c_str(), r->ops, r->nsPerOp, r->extra.c_str());
+    std::map<std::string, double>::const_iterator base = baseline.find(r->name);
+    if(base != baseline.end() && base->second > 0) {
+      double change = (r->nsPerOp / base->second - 1) * 100;
+      bool regressed = change > tolerance;
+      printf(",\"baseline_ns_per_op\":%.1f,\"change_pct\":%.1f,\"regressed\":%s", base->second, change, regressed ? "true" : "false");
+      ok = ok && !regressed;
+    }
+    printf("}\n");
+  }
+  return ok;
+}
+
+int main(int argc, char **argv) {
+  const char *baselinePath = NULL;
+  double tolerance = 15;
+  for(int i=1; i<argc; i++) {
+    if(strcmp(argv[i], "--quick") == 0) {
+      quick = true;
+    } else if(strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+      baselinePath = argv[++i];
+    } else if(strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) {
+      tolerance = atof(argv[++i]);
+    } else {
+      fprintf(stderr, "Usage: %s [--quick] [--baseline results.json] [--tolerance percent]\n", argv[0]);
+      return 2;
+    }
+  }
+  std::map<std::string, double> baseline;
+  if(baselinePath && !readBaseline(baselinePath, &baseline)) {
+    fprintf(stderr, "Could not read %s\n", baselinePath);
+    return 2;
+  }
+
+  hostOnPublish(countPublish);
+  WiFiClient client;
+  PubSubClient mqtt(client);
+  IOHandler io;
+  MessageHandler handler(&mqtt, "bench", &io);
+  io.setup();
+  handler.setup();
+  mqtt.connect("bench");
+
+  for(int run=0; run<(quick ? 1 : BENCH_RUNS); run++) {
+    benchParseText(&handler);
+    benchParseBinary(&handler);
+    benchFormatResponse();
+    benchHandleRequest(&handler);
+    benchSchedulerTick<10>("scheduler_tick_10");
+    benchSchedulerTick<100>("scheduler_tick_100");
+    benchSchedulerTick<1000>("scheduler_tick_1000");
+  }
+  // Runs the sketch, which can only be set up once
+  benchLoopFlood();
+
+  return printResults(baseline, tolerance) ? 0 : 1;
+}
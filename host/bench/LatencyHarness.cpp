@@ -0,0 +1,395 @@
+/*
+ * LatencyHarness
+ * End-to-end command latency of the whole sketch on the host build.
+ * Commands are published to the in-process broker at a given rate and
+ * mix, and each is timed from its publish until the device answers on
+ * /response/<pin>, /error or /batch. Prints one JSON object per command
+ * of the mix and one for all of them. With --baseline the latencies are
+ * compared against an earlier run and the exit code is 1 if any got worse
+ * than the tolerance, 15 % by default.
+ *
+ * @author Steinar Thorshaug
+ */
+#include <vector>
+#include <deque>
+#include <string>
+#include <map>
+#include <random>
+#include <algorithm>
+#include "HostHal.h"
+#include "MessageHandler.h"
+
+// From the sketch
+void setup();
+void loop();
+extern const char *MQTT_TOPIC_STATUS_BASE;
+extern const char *MQTT_TOPIC_SUBSCRIBE;
+
+const char *DEFAULT_MIX = "ToggleOnOff;4;20@4,ReadValues;4;0@2,ToggleOnOff;9;5@1,Unknown;4;0@1,ToggleOnOff;4;5|ReadValues;4;0@1";
+const uint64_t CONNECT_TIME = 3000000;  // Virtual us for the sketch to connect before the first command
+const uint64_t DRAIN_TIME = 2000000;    // Virtual us to wait for answers after the last command
+const int AHEAD = 64;                   // Commands queued at the broker ahead of the clock
+const double LATENCY_FLOOR = 1000;      // us, changes below this are steps of the virtual clock
+const int PIN_ERROR = -1;               // Key of answers on /error
+const int PIN_BATCH = -2;               // Key of answers on /batch
+
+/*
+ * One command of the mix
+ */
+struct MixEntry {
+  std::string         payload;
+  unsigned int        weight;
+  int                 pin;      // Where the answer is expected, or PIN_ERROR / PIN_BATCH
+  int                 req;      // Request type in the answer
+  unsigned long       sent;
+  unsigned long       answered;
+  unsigned long       busy;
+  std::vector<double> latencies; // us
+};
+
+/*
+ * One published command waiting for its answer
+ */
+struct SentCommand {
+  int      entry;
+  uint64_t at;
+  bool     answered;
+};
+
+static std::vector<MixEntry> mix;
+static std::vector<SentCommand> commands;
+static std::map<std::pair<int, int>, std::deque<size_t> > waiting; // (pin, req) -> commands in publish order
+static unsigned long unexpected = 0;
+static unsigned long completions = 0;
+
+/**
+ * Number of a request name as in the answers, REQ_None if unknown
+ */
+static int requestType(const std::string &name) {
+  static const char *names[] = { "", "ToggleOnOff", "ReadValues", "Fade", "Sequence" };
+  for(int i=1; i<MessageHandler::REQ_Count; i++) {
+    if(name == names[i]) {
+      return i;
+    }
+  }
+  return MessageHandler::REQ_None;
+}
+
+/**
+ * Work out where a text command is answered, like the device decodes it
+ */
+static void expectAnswer(MixEntry *entry) {
+  const std::string &p = entry->payload;
+  if(p.find('|') != std::string::npos || (!p.empty() && p[0] == '!')) {
+    entry->pin = PIN_BATCH;
+    entry->req = -1;
+    return;
+  }
+  size_t nameEnd = p.find(';');
+  entry->req = requestType(p.substr(0, nameEnd));
+  entry->pin = PIN_ERROR;
+  if(entry->req == MessageHandler::REQ_None || nameEnd == std::string::npos) {
+    return;
+  }
+  char *end;
+  long pin = strtol(p.c_str() + nameEnd + 1, &end, 10);
+  if(end != p.c_str() + nameEnd + 1 && (*end == ';' || *end == 0) && pin >= 0 && pin <= MAX_PINNUMBER) {
+    entry->pin = (int)pin;
+  }
+}
+
+/**
+ * Parse a mix: command@weight,command@weight,... The weight defaults to 1
+ */
+static bool parseMix(const char *text) {
+  std::string all(text);
+  size_t pos = 0;
+  while(pos <= all.size()) {
+    size_t end = all.find(',', pos);
+    if(end == std::string::npos) {
+      end = all.size();
+    }
+    std::string item = all.substr(pos, end - pos);
+    MixEntry entry;
+    entry.weight = 1;
+    size_t at = item.rfind('@');
+    if(at != std::string::npos) {
+      entry.weight = (unsigned int)atoi(item.c_str() + at + 1);
+      item = item.substr(0, at);
+    }
+    if(item.empty() || entry.weight == 0) {
+      return false;
+    }
+    entry.payload = item;
+    entry.sent = 0;
+    entry.answered = 0;
+    entry.busy = 0;
+    expectAnswer(&entry);
+    mix.push_back(entry);
+    pos = end + 1;
+  }
+  return !mix.empty();
+}
+
+/**
+ * Commands the broker has handed to the device, they are delivered in order
+ */
+static size_t deliveredCount() {
+  return commands.size() - hostDeliveryPending();
+}
+
+/**
+ * Record the answer to a command
+ */
+static void answer(size_t index, bool busy) {
+  SentCommand *command = &commands[index];
+  MixEntry *entry = &mix[command->entry];
+  command->answered = true;
+  entry->answered++;
+  if(busy) {
+    entry->busy++;
+  }
+  entry->latencies.push_back((double)(hostMicros() - command->at));
+}
+
+/**
+ * Match a message from the device with the command it answers
+ * Answers to one pin and request type come in publish order, except that
+ * a busy answer goes to the newest command, and one read answers all the
+ * reads of the pin that were merged while it was queued.
+ */
+static void onPublish(const char *topic, const uint8_t *payload, unsigned int length) {
+  static const size_t baseLength = strlen(MQTT_TOPIC_STATUS_BASE);
+  char text[1024];
+  int pin;
+
+  if(strncmp(topic, MQTT_TOPIC_STATUS_BASE, baseLength) != 0) {
+    return;
+  }
+  topic += baseLength;
+  length = min(length, (unsigned int)sizeof(text) - 1);
+  memcpy(text, payload, length);
+  text[length] = 0;
+  if(strncmp(topic, "/response/", 10) == 0) {
+    pin = atoi(topic + 10);
+  } else if(strcmp(topic, "/error") == 0) {
+    pin = PIN_ERROR;
+  } else if(strcmp(topic, "/batch") == 0) {
+    if(strstr(text, "\"more\":true")) {
+      return;
+    }
+    pin = PIN_BATCH;
+  } else {
+    return;
+  }
+  if(strstr(text, " finished\"")) {
+    // The end of a pulse or fade, the request was answered when it started
+    completions++;
+    return;
+  }
+  const char *reqField = strstr(text, "\"req\":");
+  int req = pin == PIN_BATCH ? -1 : (reqField ? atoi(reqField + 6) : MessageHandler::REQ_None);
+  bool busy = strstr(text, "\"message\":\"Busy\"") != NULL;
+
+  std::deque<size_t> *queue = &waiting[std::make_pair(pin, req)];
+  size_t delivered = deliveredCount();
+  if(queue->empty() || queue->front() >= delivered) {
+    unexpected++;
+    return;
+  }
+  if(busy) {
+    // The newest delivered command
+    std::deque<size_t>::iterator newest = std::lower_bound(queue->begin(), queue->end(), delivered) - 1;
+    answer(*newest, true);
+    queue->erase(newest);
+  } else if(req == MessageHandler::REQ_ReadValues) {
+    while(!queue->empty() && queue->front() < delivered) {
+      answer(queue->front(), false);
+      queue->pop_front();
+    }
+  } else {
+    answer(queue->front(), false);
+    queue->pop_front();
+  }
+}
+
+/**
+ * Nearest rank percentile of sorted samples
+ */
+static double percentile(const std::vector<double> &sorted, double p) {
+  if(sorted.empty()) {
+    return 0;
+  }
+  size_t rank = (size_t)(p / 100 * (sorted.size() - 1) + 0.5);
+  return sorted[rank];
+}
+
+/**
+ * Read p50_us and p99_us of each command from an earlier run
+ */
+static bool readBaseline(const char *path, std::map<std::string, std::pair<double, double> > *baseline) {
+  FILE *file = fopen(path, "r");
+  if(!file) {
+    return false;
+  }
+  char line[1024];
+  while(fgets(line, sizeof(line), file)) {
+    char command[512];
+    const char *p50 = strstr(line, "\"p50_us\":");
+    const char *p99 = strstr(line, "\"p99_us\":");
+    if(sscanf(line, "{\"command\":\"%511[^\"]\"", command) == 1 && p50 && p99) {
+      (*baseline)[command] = std::make_pair(atof(p50 + 9), atof(p99 + 9));
+    }
+  }
+  fclose(file);
+  return true;
+}
+
+/**
+ * Compare a latency with the baseline, adding the JSON fields
+ * Latencies under LATENCY_FLOOR count as the floor, so a baseline of 0
+ * still catches a regression. Returns false if it is worse than the
+ * tolerance allows.
+ */
+static bool compare(const char *name, double value, double base, double tolerance, std::string *json) {
+  char field[100];
+  double change = (max(value, LATENCY_FLOOR) / max(base, LATENCY_FLOOR) - 1) * 100;
+  snprintf(field, sizeof(field), ",\"baseline_%s\":%.0f,\"%s_change_pct\":%.1f", name, base, name, change);
+  *json += field;
+  return change <= tolerance;
+}
+
+/**
+ * Print a result line, compared against the baseline if there is one
+ * Returns false if a latency regressed
+ */
+static bool printResult(const std::string &command, unsigned long sent, unsigned long answered, unsigned long busy,
+                        std::vector<double> latencies, const std::string &extra,
+                        const std::map<std::string, std::pair<double, double> > &baseline, double tolerance) {
+  char line[512];
+  std::sort(latencies.begin(), latencies.end());
+  double p50 = percentile(latencies, 50);
+  double p99 = percentile(latencies, 99);
+  snprintf(line, sizeof(line), "{\"command\":\"%s\",\"sent\":%lu,\"answered\":%lu,\"busy\":%lu,\"unanswered\":%lu,"
+    "\"p50_us\":%.0f,\"p99_us\":%.0f,\"max_us\":%.0f",
+    command.c_str(), sent, answered, busy, sent - answered, p50, p99, latencies.empty() ? 0 : latencies.back());
+  std::string json(line);
+  json += extra;
+  bool ok = true;
+  std::map<std::string, std::pair<double, double> >::const_iterator base = baseline.find(command);
+  if(base != baseline.end()) {
+    ok = compare("p50_us", p50, base->second.first, tolerance, &json);
+    ok = compare("p99_us", p99, base->second.second, tolerance, &json) && ok;
+    json += ok ? ",\"regressed\":false" : ",\"regressed\":true";
+  }
+  printf("%s}\n", json.c_str());
+  return ok;
+}
+
+int main(int argc, char **argv) {
+  const char *mixText = DEFAULT_MIX;
+  const char *baselinePath = NULL;
+  double rate = 200;           // Commands per virtual second
+  double duration = 20;        // Virtual s
+  double cpuScale = 30;        // Host CPU time to device time
+  double tolerance = 15;
+  bool poisson = false;
+  unsigned long seed = 1;
+  for(int i=1; i<argc; i++) {
+    if(strcmp(argv[i], "--quick") == 0) {
+      duration = 2;
+    } else if(strcmp(argv[i], "--poisson") == 0) {
+      poisson = true;
+    } else if(strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+      rate = atof(argv[++i]);
+    } else if(strcmp(argv[i], "--duration") == 0 && i + 1 < argc) {
+      duration = atof(argv[++i]);
+    } else if(strcmp(argv[i], "--mix") == 0 && i + 1 < argc) {
+      mixText = argv[++i];
+    } else if(strcmp(argv[i], "--cpu-scale") == 0 && i + 1 < argc) {
+      cpuScale = atof(argv[++i]);
+    } else if(strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+      seed = strtoul(argv[++i], NULL, 10);
+    } else if(strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+      baselinePath = argv[++i];
+    } else if(strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) {
+      tolerance = atof(argv[++i]);
+    } else {
+      fprintf(stderr, "Usage: %s [--quick] [--rate per_s] [--duration s] [--poisson] [--mix command@weight,...]\n"
+        "         [--cpu-scale factor] [--seed n] [--baseline results.json] [--tolerance percent]\n", argv[0]);
+      return 2;
+    }
+  }
+  if(rate <= 0 || duration <= 0 || !parseMix(mixText)) {
+    fprintf(stderr, "Invalid rate, duration or mix\n");
+    return 2;
+  }
+  std::map<std::string, std::pair<double, double> > baseline;
+  if(baselinePath && !readBaseline(baselinePath, &baseline)) {
+    fprintf(stderr, "Could not read %s\n", baselinePath);
+    return 2;
+  }
+
+  std::mt19937 random(seed);
+  std::exponential_distribution<double> gap(rate);
+  std::vector<unsigned int> weights;
+  for(size_t i=0; i<mix.size(); i++) {
+    weights.push_back(mix[i].weight);
+  }
+  std::discrete_distribution<int> pick(weights.begin(), weights.end());
+
+  hostSetSeed(seed);
+  hostOnPublish(onPublish);
+  hostSetCpuScale(cpuScale);
+  hostCpuBegin();
+  setup();
+  while(hostMicros() < CONNECT_TIME) {
+    loop();
+  }
+
+  uint64_t start = hostMicros();
+  uint64_t end = start + (uint64_t)(duration * 1000000);
+  double nextCommand = (double)start;
+  unsigned long notQueued = 0;
+  while(hostMicros() < end + DRAIN_TIME) {
+    // The harness itself does not take device time. Commands that are due
+    // are always offered, when the broker queue is full they are dropped
+    hostCpuEnd();
+    while(nextCommand < end && (nextCommand <= hostMicros() || hostDeliveryPending() < AHEAD)) {
+      int i = pick(random);
+      SentCommand command = { i, (uint64_t)nextCommand, false };
+      if(hostDeliver(MQTT_TOPIC_SUBSCRIBE, (const uint8_t*)mix[i].payload.c_str(), mix[i].payload.size(), command.at)) {
+        waiting[std::make_pair(mix[i].pin, mix[i].req)].push_back(commands.size());
+        commands.push_back(command);
+        mix[i].sent++;
+      } else {
+        notQueued++;
+      }
+      nextCommand += poisson ? gap(random) * 1000000 : 1000000 / rate;
+    }
+    hostCpuBegin();
+    loop();
+  }
+  hostCpuEnd();
+
+  unsigned long sent = 0;
+  unsigned long answered = 0;
+  unsigned long busy = 0;
+  std::vector<double> all;
+  bool ok = true;
+  for(size_t i=0; i<mix.size(); i++) {
+    MixEntry *entry = &mix[i];
+    ok = printResult(entry->payload, entry->sent, entry->answered, entry->busy, entry->latencies, "", baseline, tolerance) && ok;
+    sent += entry->sent;
+    answered += entry->answered;
+    busy += entry->busy;
+    all.insert(all.end(), entry->latencies.begin(), entry->latencies.end());
+  }
+  char extra[300];
+  snprintf(extra, sizeof(extra), ",\"rate_per_s\":%.1f,\"duration_s\":%.1f,\"throughput_per_s\":%.1f,\"dropped\":%lu,"
+    "\"unexpected\":%lu,\"completions\":%lu,\"cpu_scale\":%.1f,\"poisson\":%s",
+    rate, duration, answered / duration, hostDeliveryDropped() + notQueued, unexpected, completions, cpuScale,
+    poisson ? "true" : "false");
+  ok = printResult("all", sent, answered, busy, all, extra, baseline, tolerance) && ok;
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,80 @@
+#ifndef Arduino_h
+#define Arduino_h
+/*
+ * Host stand-in for the ESP8266 Arduino core
+ * Only what the controller uses. Time comes from the virtual clock in
+ * HostHal.cpp, see HostHal.h for the controls.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <math.h>
+#include <algorithm>
+
+using std::min;
+using std::max;
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define IRAM_ATTR
+#define PSTR(s) (s)
+#define vsnprintf_P vsnprintf
+
+#define HIGH 0x1
+#define LOW  0x0
+#define INPUT  0x00
+#define OUTPUT 0x01
+#define CHANGE 3
+#define A0 17
+#define BUILTIN_LED 2
+
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+#define digitalPinToInterrupt(p) (p)
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void yield();
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+int analogRead(uint8_t pin);
+void analogWrite(uint8_t pin, int value);
+void analogWriteFreq(uint32_t freq);
+void analogWriteRange(uint32_t range);
+void attachInterruptArg(uint8_t pin, void (*handler)(void*), void *arg, int mode);
+void noInterrupts();
+void interrupts();
+
+long random(long howbig);
+long random(long howsmall, long howbig);
+
+class HardwareSerial {
+  public:
+    void begin(unsigned long baud);
+    int availableForWrite();
+    size_t write(const uint8_t *buffer, size_t size);
+};
+extern HardwareSerial Serial;
+
+struct rst_info;
+
+class EspClass {
+  public:
+    uint32_t getChipId();
+    uint32_t getFreeHeap();
+    uint32_t getMaxFreeBlockSize();
+    uint8_t getHeapFragmentation();
+    bool rtcUserMemoryRead(uint32_t offset, uint32_t *data, size_t size);
+    bool rtcUserMemoryWrite(uint32_t offset, uint32_t *data, size_t size);
+    struct rst_info *getResetInfoPtr();
+};
+extern EspClass ESP;
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef ESP8266WiFi_h
+#define ESP8266WiFi_h
+#include <Arduino.h>
+#include "IPAddress.h"
+
+/*
+ * Host stand-in for the WiFi station and its TCP client
+ * The link is up or down as set with hostSetWifi().
+ */
+typedef enum {
+  WL_IDLE_STATUS = 0,
+  WL_NO_SSID_AVAIL = 1,
+  WL_CONNECTED = 3,
+  WL_CONNECT_FAILED = 4,
+  WL_DISCONNECTED = 6
+} wl_status_t;
+
+typedef enum { WIFI_OFF = 0, WIFI_STA = 1 } WiFiMode_t;
+typedef enum { WIFI_NONE_SLEEP = 0, WIFI_LIGHT_SLEEP = 1, WIFI_MODEM_SLEEP = 2 } WiFiSleepType_t;
+
+class ESP8266WiFiClass {
+  public:
+    wl_status_t begin(const char *ssid, const char *passphrase = NULL, int32_t channel = 0, const uint8_t *bssid = NULL, bool connect = true);
+    bool config(IPAddress local, IPAddress gateway, IPAddress subnet, IPAddress dns1 = (uint32_t)0, IPAddress dns2 = (uint32_t)0);
+    bool reconnect();
+    bool mode(WiFiMode_t mode);
+    void persistent(bool persistent);
+    bool setSleepMode(WiFiSleepType_t type, uint8_t listenInterval = 0);
+    wl_status_t status();
+    IPAddress localIP();
+    IPAddress gatewayIP();
+    IPAddress subnetMask();
+    IPAddress dnsIP(uint8_t index = 0);
+    uint8_t *BSSID();
+    int32_t channel();
+    int32_t RSSI();
+};
+extern ESP8266WiFiClass WiFi;
+
+class Client {
+  public:
+    virtual ~Client() {}
+    virtual int available() = 0;
+};
+
+class WiFiClient : public Client {
+  public:
+    int available();
+    void setTimeout(unsigned long timeout);
+};
+
+#endif
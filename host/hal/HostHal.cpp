@@ -0,0 +1,774 @@
+/*
+ * HostHal
+ * Host stand-in for the ESP8266 Arduino core, the SDK, WiFi, UDP and
+ * PubSubClient, driven by a virtual clock. Lets the controller run and be
+ * measured on Linux.
+ *
+ * @author Steinar Thorshaug
+ */
+#include <chrono>
+#include "HostHal.h"
+#include "ESP8266WiFi.h"
+#include "WiFiUdp.h"
+#include "PubSubClient.h"
+#include "Ticker.h"
+#include "Wire.h"
+#include "user_interface.h"
+#include "lwip/dns.h"
+#include "lwip/dhcp.h"
+
+const int HOST_PINS = 18;                // GPIO 0-16 and A0
+const int HOST_DELIVERY_QUEUE = 256;     // Messages to the device waiting for delivery
+const unsigned int HOST_PAYLOAD_SIZE = 1024;
+const unsigned int HOST_TOPIC_SIZE = 64;
+const int NTP_PACKET_SIZE = 48;
+const uint32_t NTP_UNIX_OFFSET = 2208988800UL; // Seconds from 1900 to 1970
+const uint32_t RTC_CALIBRATION = 6 << 12;      // us per RTC tick, Q12
+
+/*
+ * Virtual clock
+ */
+static uint64_t clockMicros = 0;
+static double cpuScale = 0;
+static double cpuCarryNs = 0;
+static bool cpuRunning = false;
+static std::chrono::steady_clock::time_point cpuMark;
+static Ticker *tickers = NULL;
+static bool inTicker = false;
+static unsigned long randomState = 1;
+static bool logEnabled = false;
+
+/*
+ * Board
+ */
+static int pinLevels[HOST_PINS];
+static void (*pinHandlers[HOST_PINS])(void*);
+static void *pinArgs[HOST_PINS];
+static int analogValue = 512;
+static uint32_t rtcMemory[128];
+static rst_info resetInfo = { REASON_DEFAULT_RST, 0, 0, 0, 0, 0, 0 };
+
+/*
+ * Network
+ */
+struct HostDelivery {
+  uint64_t     at;
+  char         topic[HOST_TOPIC_SIZE];
+  uint8_t      payload[HOST_PAYLOAD_SIZE];
+  unsigned int length;
+};
+
+static bool wifiUp = true;
+static unsigned long dhcpLease = 3600;       // s, renewed at every association
+static uint64_t dhcpAckAt = 0;
+static struct dhcp dhcpState;
+static struct netif stationNetif = { &dhcpState };
+struct netif *netif_default = &stationNetif;
+static bool brokerUp = true;
+static HostPublishHandler publishHandler = NULL;
+static HostDelivery deliveries[HOST_DELIVERY_QUEUE];
+static int deliveryHead = 0;
+static int deliveryCount = 0;
+static unsigned long deliveryDropped = 0;
+static int64_t utcAtZero = 1700000000000LL;  // UTC in ms at virtual time 0
+static unsigned long ntpRoundTrip = 20;
+static uint8_t ntpReply[NTP_PACKET_SIZE];
+static bool ntpSent = false;
+static bool ntpReadable = false;
+static uint64_t ntpReplyAt = 0;
+
+HardwareSerial Serial;
+EspClass ESP;
+ESP8266WiFiClass WiFi;
+TwoWire Wire;
+
+/**
+ * Add the scaled host CPU time used since the last call to the clock
+ */
+static void chargeCpu() {
+  if(!cpuRunning || cpuScale <= 0) {
+    return;
+  }
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  double ns = std::chrono::duration<double, std::nano>(now - cpuMark).count() * cpuScale + cpuCarryNs;
+  uint64_t us = (uint64_t)(ns / 1000);
+  cpuCarryNs = ns - (double)us * 1000;
+  clockMicros += us;
+  cpuMark = now;
+}
+
+/**
+ * Run the tickers that are due, in deadline order
+ */
+static void runTickers() {
+  if(inTicker) {
+    return;
+  }
+  inTicker = true;
+  for(;;) {
+    Ticker *due = NULL;
+    for(Ticker *t=tickers; t; t=t->next) {
+      if(t->deadline <= clockMicros && (!due || t->deadline < due->deadline)) {
+        due = t;
+      }
+    }
+    if(!due) {
+      break;
+    }
+    void (*callback)(void*) = due->callback;
+    void *arg = due->arg;
+    if(due->repeat) {
+      due->deadline += due->interval;
+    } else {
+      due->detach();
+    }
+    callback(arg);
+  }
+  inTicker = false;
+}
+
+/**
+ * Virtual time in us
+ */
+uint64_t hostMicros() {
+  chargeCpu();
+  return clockMicros;
+}
+
+/**
+ * Move the clock forward, running the tickers on the way
+ */
+void hostAdvance(uint64_t micros) {
+  uint64_t target = hostMicros() + micros;
+  for(;;) {
+    uint64_t next = target;
+    for(Ticker *t=tickers; t; t=t->next) {
+      next = min(next, t->deadline);
+    }
+    clockMicros = max(clockMicros, next);
+    runTickers();
+    if(next >= target) {
+      break;
+    }
+  }
+  if(cpuRunning) {
+    cpuMark = std::chrono::steady_clock::now();
+  }
+}
+
+/**
+ * Let host CPU time move the clock, multiplied by scale
+ * 0 keeps the clock fully virtual. A scale near the speed ratio between
+ * the host and the ESP8266 makes work take time like on the device.
+ */
+void hostSetCpuScale(double scale) {
+  cpuScale = scale;
+}
+
+/**
+ * Start counting host CPU time, around a call into the firmware
+ */
+void hostCpuBegin() {
+  cpuRunning = true;
+  cpuMark = std::chrono::steady_clock::now();
+}
+
+/**
+ * Stop counting host CPU time
+ */
+void hostCpuEnd() {
+  chargeCpu();
+  cpuRunning = false;
+}
+
+/**
+ * Seed random(), runs with the same seed are repeatable
+ */
+void hostSetSeed(unsigned long seed) {
+  randomState = seed ? seed : 1;
+}
+
+/**
+ * Copy the firmware UART output to stderr
+ */
+void hostSetLog(bool enabled) {
+  logEnabled = enabled;
+}
+
+/**
+ * Bring the WiFi link up or down
+ */
+void hostSetWifi(bool up) {
+  if(up && !wifiUp) {
+    dhcpAckAt = hostMicros();
+  }
+  wifiUp = up;
+}
+
+/**
+ * DHCP lease time in s given at the next association
+ */
+void hostSetDhcpLease(unsigned long seconds) {
+  dhcpLease = seconds;
+}
+
+/**
+ * DHCP client state of the station, the lease used up by the virtual clock
+ * The lease is renewed when half of it is used, like lwIP does.
+ */
+struct dhcp *hostDhcpData(struct netif *netif) {
+  struct dhcp *dhcp = (struct dhcp*)netif->client_data;
+  uint64_t ticks = (hostMicros() - dhcpAckAt) / 1000000 / DHCP_COARSE_TIMER_SECS;
+  dhcp->t0_timeout = (uint16_t)((dhcpLease + DHCP_COARSE_TIMER_SECS - 1) / DHCP_COARSE_TIMER_SECS);
+  dhcp->lease_used = (uint16_t)(ticks % max(dhcp->t0_timeout / 2, 1));
+  return dhcp;
+}
+
+/**
+ * Make the broker reachable or not
+ * Going down drops the connection of the device.
+ */
+void hostSetBroker(bool up) {
+  brokerUp = up;
+}
+
+/**
+ * Receive everything the device publishes
+ */
+void hostOnPublish(HostPublishHandler handler) {
+  publishHandler = handler;
+}
+
+/**
+ * Queue a message to the device, delivered by PubSubClient::loop() from
+ * the given virtual time. Messages must be queued in time order.
+ * Returns false if the queue is full.
+ */
+bool hostDeliver(const char *topic, const uint8_t *payload, unsigned int length, uint64_t atMicros) {
+  if(deliveryCount == HOST_DELIVERY_QUEUE || length > HOST_PAYLOAD_SIZE || strlen(topic) >= HOST_TOPIC_SIZE) {
+    return false;
+  }
+  HostDelivery *d = &deliveries[(deliveryHead + deliveryCount) % HOST_DELIVERY_QUEUE];
+  d->at = atMicros;
+  strcpy(d->topic, topic);
+  memcpy(d->payload, payload, length);
+  d->length = length;
+  deliveryCount++;
+  return true;
+}
+
+/**
+ * Messages to the device not delivered yet
+ */
+int hostDeliveryPending() {
+  return deliveryCount;
+}
+
+/**
+ * Messages to the device dropped because they did not fit the client buffer
+ */
+unsigned long hostDeliveryDropped() {
+  return deliveryDropped;
+}
+
+/**
+ * Set the UTC time in ms served by the NTP server, from now on
+ */
+void hostSetUtc(int64_t utcMillis) {
+  utcAtZero = utcMillis - (int64_t)(hostMicros() / 1000);
+}
+
+/**
+ * Round trip of NTP queries in ms, split evenly between the directions
+ */
+void hostSetNtpDelay(unsigned long roundTripMillis) {
+  ntpRoundTrip = roundTripMillis;
+}
+
+/**
+ * Drive an input pin, running its interrupt handler on a change
+ */
+void hostSetPin(int pin, int level) {
+  if(pin < 0 || pin >= HOST_PINS || pinLevels[pin] == level) {
+    return;
+  }
+  pinLevels[pin] = level;
+  if(pinHandlers[pin]) {
+    pinHandlers[pin](pinArgs[pin]);
+  }
+}
+
+/**
+ * Level of a pin
+ */
+int hostPin(int pin) {
+  return pin >= 0 && pin < HOST_PINS ? pinLevels[pin] : 0;
+}
+
+/**
+ * Value returned by analogRead()
+ */
+void hostSetAnalog(int value) {
+  analogValue = value;
+}
+
+/**
+ * Reset reason reported by ESP.getResetInfoPtr()
+ */
+void hostSetResetReason(uint32_t reason) {
+  resetInfo.reason = reason;
+}
+
+/*
+ * Arduino core
+ */
+unsigned long millis() {
+  return (unsigned long)(hostMicros() / 1000);
+}
+
+unsigned long micros() {
+  return (unsigned long)hostMicros();
+}
+
+void delay(unsigned long ms) {
+  hostAdvance((uint64_t)ms * 1000);
+}
+
+void yield() {
+  chargeCpu();
+  runTickers();
+}
+
+void pinMode(uint8_t, uint8_t) {
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+  if(pin < HOST_PINS) {
+    pinLevels[pin] = value;
+  }
+}
+
+int digitalRead(uint8_t pin) {
+  return hostPin(pin);
+}
+
+int analogRead(uint8_t) {
+  return analogValue;
+}
+
+void analogWrite(uint8_t pin, int value) {
+  if(pin < HOST_PINS) {
+    pinLevels[pin] = value;
+  }
+}
+
+void analogWriteFreq(uint32_t) {
+}
+
+void analogWriteRange(uint32_t) {
+}
+
+void attachInterruptArg(uint8_t pin, void (*handler)(void*), void *arg, int) {
+  if(pin < HOST_PINS) {
+    pinHandlers[pin] = handler;
+    pinArgs[pin] = arg;
+  }
+}
+
+void noInterrupts() {
+}
+
+void interrupts() {
+}
+
+long random(long howbig) {
+  if(howbig <= 0) {
+    return 0;
+  }
+  randomState = randomState * 1103515245UL + 12345UL;
+  return (long)((randomState >> 16) % (unsigned long)howbig);
+}
+
+long random(long howsmall, long howbig) {
+  return howsmall >= howbig ? howsmall : howsmall + random(howbig - howsmall);
+}
+
+void HardwareSerial::begin(unsigned long) {
+}
+
+int HardwareSerial::availableForWrite() {
+  return 128;
+}
+
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size) {
+  if(logEnabled) {
+    fwrite(buffer, 1, size, stderr);
+  }
+  return size;
+}
+
+uint32_t EspClass::getChipId() {
+  return 0xC0FFEE;
+}
+
+uint32_t EspClass::getFreeHeap() {
+  return 40000;
+}
+
+uint32_t EspClass::getMaxFreeBlockSize() {
+  return 32000;
+}
+
+uint8_t EspClass::getHeapFragmentation() {
+  return 5;
+}
+
+bool EspClass::rtcUserMemoryRead(uint32_t offset, uint32_t *data, size_t size) {
+  if(offset * 4 + size > sizeof(rtcMemory)) {
+    return false;
+  }
+  memcpy(data, (uint8_t*)rtcMemory + offset * 4, size);
+  return true;
+}
+
+bool EspClass::rtcUserMemoryWrite(uint32_t offset, uint32_t *data, size_t size) {
+  if(offset * 4 + size > sizeof(rtcMemory)) {
+    return false;
+  }
+  memcpy((uint8_t*)rtcMemory + offset * 4, data, size);
+  return true;
+}
+
+rst_info *EspClass::getResetInfoPtr() {
+  return &resetInfo;
+}
+
+uint32_t system_get_rtc_time(void) {
+  return (uint32_t)((hostMicros() << 12) / RTC_CALIBRATION);
+}
+
+uint32_t system_rtc_clock_cali_proc(void) {
+  return RTC_CALIBRATION;
+}
+
+Ticker::Ticker() {
+  this->deadline = 0;
+  this->interval = 0;
+  this->repeat = false;
+  this->callback = NULL;
+  this->arg = NULL;
+  this->next = NULL;
+}
+
+Ticker::~Ticker() {
+  this->detach();
+}
+
+void Ticker::attach(uint32_t milliseconds, bool repeat, void (*callback)(void*), void *arg) {
+  this->detach();
+  this->interval = (uint64_t)max(milliseconds, (uint32_t)1) * 1000;
+  this->deadline = hostMicros() + this->interval;
+  this->repeat = repeat;
+  this->callback = callback;
+  this->arg = arg;
+  this->next = tickers;
+  tickers = this;
+}
+
+void Ticker::detach() {
+  for(Ticker **t=&tickers; *t; t=&(*t)->next) {
+    if(*t == this) {
+      *t = this->next;
+      break;
+    }
+  }
+  this->callback = NULL;
+  this->next = NULL;
+}
+
+bool Ticker::active() const {
+  return this->callback != NULL;
+}
+
+/*
+ * WiFi
+ */
+wl_status_t ESP8266WiFiClass::begin(const char*, const char*, int32_t, const uint8_t*, bool) {
+  dhcpAckAt = hostMicros();
+  return this->status();
+}
+
+bool ESP8266WiFiClass::config(IPAddress, IPAddress, IPAddress, IPAddress, IPAddress) {
+  return true;
+}
+
+bool ESP8266WiFiClass::reconnect() {
+  return true;
+}
+
+bool ESP8266WiFiClass::mode(WiFiMode_t) {
+  return true;
+}
+
+void ESP8266WiFiClass::persistent(bool) {
+}
+
+bool ESP8266WiFiClass::setSleepMode(WiFiSleepType_t, uint8_t) {
+  return true;
+}
+
+wl_status_t ESP8266WiFiClass::status() {
+  return wifiUp ? WL_CONNECTED : WL_DISCONNECTED;
+}
+
+IPAddress ESP8266WiFiClass::localIP() {
+  return wifiUp ? IPAddress(192, 168, 1, 50) : IPAddress();
+}
+
+IPAddress ESP8266WiFiClass::gatewayIP() {
+  return IPAddress(192, 168, 1, 1);
+}
+
+IPAddress ESP8266WiFiClass::subnetMask() {
+  return IPAddress(255, 255, 255, 0);
+}
+
+IPAddress ESP8266WiFiClass::dnsIP(uint8_t) {
+  return IPAddress(192, 168, 1, 1);
+}
+
+uint8_t *ESP8266WiFiClass::BSSID() {
+  static uint8_t bssid[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+  return bssid;
+}
+
+int32_t ESP8266WiFiClass::channel() {
+  return 6;
+}
+
+int32_t ESP8266WiFiClass::RSSI() {
+  return -60;
+}
+
+/**
+ * Check if a message to the device is due
+ */
+static HostDelivery *dueDelivery() {
+  if(deliveryCount == 0 || deliveries[deliveryHead].at > hostMicros()) {
+    return NULL;
+  }
+  return &deliveries[deliveryHead];
+}
+
+int WiFiClient::available() {
+  return wifiUp && brokerUp && dueDelivery() ? 1 : 0;
+}
+
+void WiFiClient::setTimeout(unsigned long) {
+}
+
+/*
+ * NTP server answering on port 123
+ */
+uint8_t WiFiUDP::begin(uint16_t port) {
+  this->port = port;
+  return 1;
+}
+
+uint16_t WiFiUDP::localPort() {
+  return this->port;
+}
+
+int WiFiUDP::beginPacket(IPAddress, uint16_t port) {
+  this->remotePort = port;
+  return 1;
+}
+
+/**
+ * Write a Unix time in ms as a 64 bit NTP timestamp
+ */
+static void writeNtpTimestamp(uint8_t *p, int64_t utcMillis) {
+  uint32_t seconds = (uint32_t)(utcMillis / 1000) + NTP_UNIX_OFFSET;
+  uint32_t fraction = (uint32_t)(((uint64_t)(utcMillis % 1000) << 32) / 1000);
+  for(int i=0; i<4; i++) {
+    p[i] = seconds >> (24 - 8 * i);
+    p[4 + i] = fraction >> (24 - 8 * i);
+  }
+}
+
+size_t WiFiUDP::write(const uint8_t *buffer, size_t size) {
+  if(this->remotePort != 123 || size < (size_t)NTP_PACKET_SIZE || !wifiUp) {
+    return size;
+  }
+  // Answer as a stratum 1 server, half way through the round trip
+  int64_t serverTime = utcAtZero + (int64_t)(hostMicros() / 1000) + ntpRoundTrip / 2;
+  memset(ntpReply, 0, sizeof(ntpReply));
+  ntpReply[0] = 0x24;
+  ntpReply[1] = 1;
+  memcpy(&ntpReply[24], &buffer[40], 8);
+  writeNtpTimestamp(&ntpReply[32], serverTime);
+  writeNtpTimestamp(&ntpReply[40], serverTime);
+  ntpSent = true;
+  ntpReadable = false;
+  ntpReplyAt = hostMicros() + (uint64_t)ntpRoundTrip * 1000;
+  return size;
+}
+
+int WiFiUDP::endPacket() {
+  return 1;
+}
+
+int WiFiUDP::parsePacket() {
+  if(ntpSent && hostMicros() >= ntpReplyAt) {
+    ntpSent = false;
+    ntpReadable = true;
+  }
+  return ntpReadable ? NTP_PACKET_SIZE : 0;
+}
+
+int WiFiUDP::read(uint8_t *buffer, size_t length) {
+  if(!ntpReadable) {
+    return 0;
+  }
+  size_t n = min(length, (size_t)NTP_PACKET_SIZE);
+  memcpy(buffer, ntpReply, n);
+  ntpReadable = false;
+  return (int)n;
+}
+
+void WiFiUDP::flush() {
+  ntpReadable = false;
+}
+
+err_t dns_gethostbyname(const char*, ip_addr_t *addr, dns_found_callback, void*) {
+  addr->addr = IPAddress(192, 168, 1, 1);
+  return ERR_OK;
+}
+
+/*
+ * I2C bus without devices
+ */
+void TwoWire::begin(int, int) {
+}
+
+void TwoWire::beginTransmission(uint8_t) {
+}
+
+size_t TwoWire::write(uint8_t) {
+  return 1;
+}
+
+size_t TwoWire::write(const uint8_t*, size_t quantity) {
+  return quantity;
+}
+
+uint8_t TwoWire::endTransmission(bool) {
+  return 2; // Address not acknowledged
+}
+
+uint8_t TwoWire::requestFrom(uint8_t, size_t) {
+  return 0;
+}
+
+int TwoWire::read() {
+  return -1;
+}
+
+/*
+ * MQTT client
+ */
+PubSubClient::PubSubClient(Client&) {
+  this->callback = NULL;
+  this->isConnected = false;
+  this->lastState = MQTT_DISCONNECTED;
+  this->subscription[0] = 0;
+}
+
+PubSubClient &PubSubClient::setServer(const char*, uint16_t) {
+  return *this;
+}
+
+PubSubClient &PubSubClient::setCallback(void (*callback)(char*, uint8_t*, unsigned int)) {
+  this->callback = callback;
+  return *this;
+}
+
+PubSubClient &PubSubClient::setSocketTimeout(uint16_t) {
+  return *this;
+}
+
+bool PubSubClient::connect(const char*) {
+  this->isConnected = wifiUp && brokerUp;
+  this->lastState = this->isConnected ? MQTT_CONNECTED : MQTT_CONNECT_FAILED;
+  return this->isConnected;
+}
+
+void PubSubClient::disconnect() {
+  this->isConnected = false;
+  this->lastState = MQTT_DISCONNECTED;
+}
+
+bool PubSubClient::connected() {
+  if(this->isConnected && (!wifiUp || !brokerUp)) {
+    this->isConnected = false;
+    this->lastState = MQTT_CONNECTION_LOST;
+  }
+  return this->isConnected;
+}
+
+int PubSubClient::state() {
+  return this->lastState;
+}
+
+bool PubSubClient::subscribe(const char *topic) {
+  if(!this->connected() || strlen(topic) >= sizeof(this->subscription)) {
+    return false;
+  }
+  strcpy(this->subscription, topic);
+  return true;
+}
+
+bool PubSubClient::publish(const char *topic, const char *payload) {
+  return this->publish(topic, (const uint8_t*)payload, strlen(payload));
+}
+
+bool PubSubClient::publish(const char *topic, const uint8_t *payload, unsigned int plength) {
+  if(!this->connected()) {
+    return false;
+  }
+  if(MQTT_MAX_HEADER_SIZE + 2 + strlen(topic) + plength > MQTT_MAX_PACKET_SIZE) {
+    return false;
+  }
+  if(publishHandler) {
+    publishHandler(topic, payload, plength);
+  }
+  return true;
+}
+
+/**
+ * Deliver at most one due message, like the library reads one packet
+ * Messages larger than the client buffer are dropped.
+ */
+bool PubSubClient::loop() {
+  if(!this->connected()) {
+    return false;
+  }
+  HostDelivery *d = dueDelivery();
+  if(!d) {
+    return true;
+  }
+  deliveryHead = (deliveryHead + 1) % HOST_DELIVERY_QUEUE;
+  deliveryCount--;
+  unsigned int topicLength = strlen(d->topic);
+  if(MQTT_MAX_HEADER_SIZE + 2 + topicLength + d->length > MQTT_MAX_PACKET_SIZE) {
+    deliveryDropped++;
+    return true;
+  }
+  if(strcmp(d->topic, this->subscription) != 0 || !this->callback) {
+    return true;
+  }
+  memcpy(this->buffer, d->topic, topicLength + 1);
+  memcpy(this->buffer + topicLength + 1, d->payload, d->length);
+  this->callback((char*)this->buffer, this->buffer + topicLength + 1, d->length);
+  return true;
+}
@@ -0,0 +1,39 @@
+#ifndef HostHal_h
+#define HostHal_h
+#include <Arduino.h>
+
+/*
+ * Controls for the host stand-in of the Arduino core
+ * Time is virtual. It only moves in delay() and hostAdvance(), or with a
+ * CPU scale, also with the host CPU time spent between hostCpuBegin() and
+ * hostCpuEnd(). Ticker callbacks run when the firmware yields or delays.
+ * The MQTT client talks to an in-process broker: messages to the device
+ * are queued with a delivery time, and messages from it go to a handler.
+ */
+typedef void (*HostPublishHandler)(const char *topic, const uint8_t *payload, unsigned int length);
+
+uint64_t hostMicros();
+void hostAdvance(uint64_t micros);
+void hostSetCpuScale(double scale);
+void hostCpuBegin();
+void hostCpuEnd();
+void hostSetSeed(unsigned long seed);
+void hostSetLog(bool enabled);
+
+void hostSetWifi(bool up);
+void hostSetDhcpLease(unsigned long seconds);
+void hostSetBroker(bool up);
+void hostOnPublish(HostPublishHandler handler);
+bool hostDeliver(const char *topic, const uint8_t *payload, unsigned int length, uint64_t atMicros);
+int hostDeliveryPending();
+unsigned long hostDeliveryDropped();
+
+void hostSetUtc(int64_t utcMillis);
+void hostSetNtpDelay(unsigned long roundTripMillis);
+
+void hostSetPin(int pin, int level);
+int hostPin(int pin);
+void hostSetAnalog(int value);
+void hostSetResetReason(uint32_t reason);
+
+#endif
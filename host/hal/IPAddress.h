@@ -0,0 +1,20 @@
+#ifndef IPAddress_h
+#define IPAddress_h
+#include <Arduino.h>
+
+/*
+ * Host stand-in for an IPv4 address, stored in network order like lwIP
+ */
+class IPAddress {
+  public:
+    IPAddress() : address(0) {}
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : address((uint32_t)a | (uint32_t)b << 8 | (uint32_t)c << 16 | (uint32_t)d << 24) {}
+    IPAddress(uint32_t address) : address(address) {}
+    operator uint32_t() const { return this->address; }
+    uint8_t operator[](int index) const { return (this->address >> (8 * index)) & 0xFF; }
+
+  private:
+    uint32_t address;
+};
+
+#endif
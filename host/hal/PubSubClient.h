@@ -0,0 +1,48 @@
+#ifndef PubSubClient_h
+#define PubSubClient_h
+#include <Arduino.h>
+#include "ESP8266WiFi.h"
+
+/*
+ * Host stand-in for the PubSubClient MQTT client
+ * Talks to the in-process broker in HostHal.cpp. Packets are limited to
+ * MQTT_MAX_PACKET_SIZE in both directions like in the library, so a
+ * message that would not fit on the device fails here too.
+ */
+#ifndef MQTT_MAX_PACKET_SIZE
+#define MQTT_MAX_PACKET_SIZE 256
+#endif
+#define MQTT_MAX_HEADER_SIZE 5
+
+#define MQTT_CONNECTION_TIMEOUT -4
+#define MQTT_CONNECTION_LOST    -3
+#define MQTT_CONNECT_FAILED     -2
+#define MQTT_DISCONNECTED       -1
+#define MQTT_CONNECTED           0
+
+#define MQTT_CALLBACK_SIGNATURE void (*callback)(char*, uint8_t*, unsigned int)
+
+class PubSubClient {
+  public:
+    PubSubClient(Client &client);
+    PubSubClient &setServer(const char *domain, uint16_t port);
+    PubSubClient &setCallback(MQTT_CALLBACK_SIGNATURE);
+    PubSubClient &setSocketTimeout(uint16_t timeout);
+    bool connect(const char *id);
+    void disconnect();
+    bool connected();
+    int state();
+    bool subscribe(const char *topic);
+    bool publish(const char *topic, const char *payload);
+    bool publish(const char *topic, const uint8_t *payload, unsigned int plength);
+    bool loop();
+
+  private:
+    MQTT_CALLBACK_SIGNATURE;
+    bool isConnected;
+    int lastState;
+    char subscription[64];
+    uint8_t buffer[MQTT_MAX_PACKET_SIZE];
+};
+
+#endif
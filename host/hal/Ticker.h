@@ -0,0 +1,40 @@
+#ifndef Ticker_h
+#define Ticker_h
+#include <Arduino.h>
+
+/*
+ * Host stand-in for the SDK software timer
+ * Callbacks run when the firmware yields or delays, like on the device,
+ * and never in parallel with loop().
+ */
+class Ticker {
+  public:
+    Ticker();
+    ~Ticker();
+
+    template<typename TArg>
+    void attach_ms(uint32_t milliseconds, void (*callback)(TArg), TArg arg) {
+      static_assert(sizeof(TArg) <= sizeof(void*), "Ticker argument must fit in a pointer");
+      this->attach(milliseconds, true, (void (*)(void*))callback, (void*)arg);
+    }
+    template<typename TArg>
+    void once_ms(uint32_t milliseconds, void (*callback)(TArg), TArg arg) {
+      static_assert(sizeof(TArg) <= sizeof(void*), "Ticker argument must fit in a pointer");
+      this->attach(milliseconds, false, (void (*)(void*))callback, (void*)arg);
+    }
+    void detach();
+    bool active() const;
+
+    // Used by the virtual clock
+    uint64_t deadline;
+    uint64_t interval;
+    bool repeat;
+    void (*callback)(void*);
+    void *arg;
+    Ticker *next;
+
+  private:
+    void attach(uint32_t milliseconds, bool repeat, void (*callback)(void*), void *arg);
+};
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef WiFiUdp_h
+#define WiFiUdp_h
+#include <Arduino.h>
+#include "IPAddress.h"
+
+/*
+ * Host stand-in for a UDP socket
+ * Packets to port 123 are answered by the NTP server in HostHal.cpp.
+ */
+class WiFiUDP {
+  public:
+    uint8_t begin(uint16_t port);
+    uint16_t localPort();
+    int beginPacket(IPAddress ip, uint16_t port);
+    size_t write(const uint8_t *buffer, size_t size);
+    int endPacket();
+    int parsePacket();
+    int read(uint8_t *buffer, size_t length);
+    void flush();
+
+  private:
+    uint16_t port;
+    uint16_t remotePort;
+};
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef Wire_h
+#define Wire_h
+#include <Arduino.h>
+
+/*
+ * Host stand-in for the I2C bus, no device ever answers
+ */
+class TwoWire {
+  public:
+    void begin(int sda, int scl);
+    void beginTransmission(uint8_t address);
+    size_t write(uint8_t data);
+    size_t write(const uint8_t *data, size_t quantity);
+    uint8_t endTransmission(bool sendStop = true);
+    uint8_t requestFrom(uint8_t address, size_t size);
+    int read();
+};
+extern TwoWire Wire;
+
+#endif
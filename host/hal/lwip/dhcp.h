@@ -0,0 +1,26 @@
+#ifndef lwip_dhcp_h
+#define lwip_dhcp_h
+/*
+ * Host stand-in for the lwIP DHCP client state, with the lease set by
+ * hostSetDhcpLease() and used up by the virtual clock
+ */
+#include <stdint.h>
+#include "lwip/netif.h"
+
+#define DHCP_COARSE_TIMER_SECS 60
+
+struct dhcp {
+  uint16_t t0_timeout; // Lease time in DHCP_COARSE_TIMER_SECS ticks
+  uint16_t lease_used; // Ticks since the last DHCP ack
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+struct dhcp *hostDhcpData(struct netif *netif);
+#ifdef __cplusplus
+}
+#endif
+#define netif_dhcp_data(netif) hostDhcpData(netif)
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef lwip_dns_h
+#define lwip_dns_h
+/*
+ * Host stand-in for the lwIP resolver, every name resolves at once
+ */
+#include <stdint.h>
+
+typedef int8_t err_t;
+#define ERR_OK          0
+#define ERR_INPROGRESS -5
+#define ERR_ARG       -16
+
+typedef struct {
+  uint32_t addr;
+} ip_addr_t;
+#define ip_addr_get_ip4_u32(ipaddr) ((ipaddr)->addr)
+
+typedef void (*dns_found_callback)(const char *name, const ip_addr_t *ipaddr, void *callback_arg);
+#ifdef __cplusplus
+extern "C" {
+#endif
+err_t dns_gethostbyname(const char *hostname, ip_addr_t *addr, dns_found_callback found, void *callback_arg);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef lwip_netif_h
+#define lwip_netif_h
+/*
+ * Host stand-in for the lwIP network interface, the station is the default
+ */
+#include <stdint.h>
+
+struct netif {
+  void *client_data;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+extern struct netif *netif_default;
+#ifdef __cplusplus
+}
+#endif
+
+#endif
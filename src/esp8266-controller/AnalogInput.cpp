@@ -0,0 +1,152 @@
+/*
+ * AnalogInput
+ * Sample, filter and aggregate the analog input
+ *
+ * @author Steinar Thorshaug
+ */
+#include "AnalogInput.h"
+
+const int FIXED_SHIFT = 8; // Filter state is ADC steps << FIXED_SHIFT
+
+static_assert((unsigned long long)AI_WINDOW_SIZE * (1023UL << FIXED_SHIFT) <= 0xFFFFFFFFUL,
+              "AI_WINDOW_SIZE too large for the 32 bit window sum");
+
+/**
+ * Convert the fixed point filter state to 0.01 ADC steps
+ */
+static long toHundredths(long value) {
+  return (value * 100) >> FIXED_SHIFT;
+}
+
+/**
+ * Constructor
+ */
+AnalogInput::AnalogInput() {
+  this->inputPin = -1;
+  this->started = false;
+  this->filtered = 0;
+  this->lastTick = 0;
+  this->samples = 0;
+  this->windowMin = 0;
+  this->windowMax = 0;
+  this->windowSum = 0;
+  this->windowJitter = 0;
+  this->windowCpu = 0;
+  this->windowValid = false;
+  this->ready = false;
+}
+
+/**
+ * Start sampling A0, reported as the given pin
+ * The ESP8266 has a single ADC, so only one analog input is supported
+ */
+bool AnalogInput::begin(int pin) {
+  if(this->inputPin >= 0) {
+    return false;
+  }
+  this->inputPin = pin;
+  this->lastTick = micros();
+  this->ticker.attach_ms(AI_SAMPLE_INTERVAL, &AnalogInput::onTick, this);
+  return true;
+}
+
+/**
+ * Check if an analog input is sampled
+ */
+bool AnalogInput::active() {
+  return this->inputPin >= 0;
+}
+
+/**
+ * Pin number the analog input is reported as
+ */
+int AnalogInput::pin() {
+  return this->inputPin;
+}
+
+/**
+ * Check if a window is waiting to be taken
+ */
+bool AnalogInput::windowReady() {
+  return this->ready;
+}
+
+/**
+ * Take a completed window
+ * Returns false if no new window is ready
+ */
+bool AnalogInput::takeWindow(AnalogInput::MyWindow *window) {
+  if(!this->ready) {
+    return false;
+  }
+  this->ready = false;
+  *window = this->window;
+  return true;
+}
+
+/**
+ * Get the latest completed window, taken or not
+ */
+bool AnalogInput::lastWindow(AnalogInput::MyWindow *window) {
+  if(!this->windowValid) {
+    return false;
+  }
+  *window = this->window;
+  return true;
+}
+
+/**
+ * Ticker callback
+ * Runs from the SDK timer task, never in parallel with loop()
+ */
+void AnalogInput::onTick(AnalogInput *self) {
+  self->sample();
+}
+
+/**
+ * Take one sample and update the filter and the window
+ */
+void AnalogInput::sample() {
+  unsigned long started = micros();
+  long raw = (long)analogRead(A0) << FIXED_SHIFT;
+
+  unsigned long interval = started - this->lastTick;
+  unsigned long expected = AI_SAMPLE_INTERVAL * 1000;
+  unsigned long jitter = interval > expected ? interval - expected : expected - interval;
+  this->lastTick = started;
+
+  if(!this->started) {
+    this->filtered = raw;
+    this->started = true;
+    jitter = 0;
+  } else {
+    this->filtered += (raw - this->filtered) >> AI_FILTER_SHIFT;
+  }
+
+  if(this->samples == 0) {
+    this->windowMin = this->filtered;
+    this->windowMax = this->filtered;
+    this->windowSum = 0;
+    this->windowJitter = 0;
+    this->windowCpu = 0;
+  }
+  this->windowMin = min(this->windowMin, this->filtered);
+  this->windowMax = max(this->windowMax, this->filtered);
+  this->windowSum += this->filtered;
+  this->windowJitter = max(this->windowJitter, jitter);
+  this->windowCpu += micros() - started;
+  this->samples++;
+
+  if(this->samples >= AI_WINDOW_SIZE) {
+    this->window.last = toHundredths(this->filtered);
+    this->window.min = toHundredths(this->windowMin);
+    this->window.max = toHundredths(this->windowMax);
+    this->window.mean = toHundredths(this->windowSum / AI_WINDOW_SIZE);
+    this->window.jitter = this->windowJitter;
+    this->window.cpu = this->windowCpu / AI_WINDOW_SIZE;
+    this->window.endedAt = millis();
+    this->windowValid = true;
+    this->ready = true;
+    this->samples = 0;
+  }
+}
@@ -0,0 +1,53 @@
+#ifndef AnalogInput_h
+#define AnalogInput_h
+#include <Arduino.h>
+#include <Ticker.h>
+#include "myconstants.h"
+
+/*
+ * Timer driven sampling of the ADC (A0)
+ * Samples are filtered by a fixed point IIR low pass and aggregated to
+ * min, max and mean over a window of AI_WINDOW_SIZE samples. Only the
+ * finished windows are handed to the main loop.
+ */
+class AnalogInput {
+  public:
+    struct MyWindow {
+      long          last;     // Filtered value at the end of the window, 0.01 ADC steps
+      long          min;
+      long          max;
+      long          mean;
+      unsigned long jitter;   // Largest deviation in us from the sample interval
+      unsigned long cpu;      // Mean us spent per sample
+      unsigned long endedAt;  // millis() when the window was completed
+    };
+
+    AnalogInput();
+    bool begin(int pin);
+    bool active();
+    int pin();
+    bool windowReady();
+    bool takeWindow(AnalogInput::MyWindow *window);
+    bool lastWindow(AnalogInput::MyWindow *window);
+
+  private:
+    Ticker ticker;
+    int inputPin;
+    bool started;
+    long filtered;          // IIR state, ADC steps << 8
+    unsigned long lastTick; // micros() of the previous sample
+    int samples;
+    long windowMin;
+    long windowMax;
+    unsigned long windowSum;
+    unsigned long windowJitter;
+    unsigned long windowCpu;
+    MyWindow window;
+    bool windowValid;
+    volatile bool ready;
+
+    static void onTick(AnalogInput *self);
+    void sample();
+};
+
+#endif
@@ -0,0 +1,235 @@
+/*
+ * AnalogOutput
+ * PWM levels, fades and sequences driven by a timer
+ *
+ * @author Steinar Thorshaug
+ */
+#include "AnalogOutput.h"
+
+/*
+ * (i/32)^2.2 scaled to 0-65535, interpolated between the points
+ */
+static const uint16_t gammaTable[33] = {
+  0, 32, 147, 359, 676, 1104, 1648, 2314, 3104, 4022, 5072, 6255, 7574, 9033, 10632, 12375,
+  14263, 16298, 18482, 20816, 23303, 25943, 28739, 31692, 34802, 38072, 41503, 45097, 48853,
+  52774, 56860, 61114, 65535
+};
+
+/**
+ * Convert a level in 0.1 % to a PWM duty cycle
+ */
+static int toDuty(int level, AnalogOutput::Curve curve) {
+  unsigned long duty;
+  if(curve == AnalogOutput::CURVE_Gamma) {
+    unsigned long x = (unsigned long)level * 32;
+    unsigned long i = x / AnalogOutput::LEVEL_MAX;
+    unsigned long frac = x % AnalogOutput::LEVEL_MAX;
+    unsigned long g = gammaTable[i];
+    if(i < 32) {
+      g += (gammaTable[i + 1] - gammaTable[i]) * frac / AnalogOutput::LEVEL_MAX;
+    }
+    duty = (g * AO_PWM_RANGE + 32767) >> 16;
+  } else {
+    duty = ((unsigned long)level * AO_PWM_RANGE + AnalogOutput::LEVEL_MAX / 2) / AnalogOutput::LEVEL_MAX;
+  }
+  // The outputs may be reversed, see OUTPUT_HIGH
+  return OUTPUT_HIGH == HIGH ? duty : AO_PWM_RANGE - duty;
+}
+
+/**
+ * Constructor
+ */
+AnalogOutput::AnalogOutput() {
+  this->ticking = false;
+  for(int i=0; i<=MAX_PINNUMBER; i++) {
+    this->channels[i].enabled = false;
+    this->channels[i].active = false;
+    this->channels[i].finished = false;
+    this->channels[i].curve = CURVE_Linear;
+    this->channels[i].level = 0;
+    this->channels[i].from = 0;
+    this->channels[i].duty = -1;
+    this->channels[i].started = 0;
+    this->channels[i].stepCount = 0;
+    this->channels[i].period = 0;
+    this->channels[i].step = 0;
+    this->channels[i].repeat = 0;
+  }
+}
+
+/**
+ * Set up the PWM frequency and resolution, shared by all outputs
+ */
+void AnalogOutput::begin() {
+  analogWriteFreq(AO_PWM_FREQUENCY);
+  analogWriteRange(AO_PWM_RANGE);
+}
+
+/**
+ * Use a pin as PWM output, starting at level 0
+ */
+bool AnalogOutput::addPin(int pin) {
+  if(pin < 0 || pin > MAX_PINNUMBER) {
+    return false;
+  }
+  MyChannel *channel = &this->channels[pin];
+  channel->enabled = true;
+  pinMode(pin, OUTPUT);
+  this->write(pin, channel);
+  return true;
+}
+
+/**
+ * Move an output to a level over a duration
+ * A duration of 0 sets the level at once.
+ */
+bool AnalogOutput::fade(int pin, int level, unsigned long duration, AnalogOutput::Curve curve) {
+  MyStep step;
+  step.level = level;
+  step.duration = duration;
+  return this->play(pin, &step, 1, 1, curve);
+}
+
+/**
+ * Play a sequence of fades
+ * The sequence is played repeat times, or until replaced if repeat is 0.
+ * Replaces whatever the output was doing and starts from the current level.
+ */
+bool AnalogOutput::play(int pin, const AnalogOutput::MyStep *steps, int count, int repeat, AnalogOutput::Curve curve) {
+  if(pin < 0 || pin > MAX_PINNUMBER || !this->channels[pin].enabled) {
+    return false;
+  }
+  if(count < 1 || count > AO_MAX_STEPS || repeat < 0 || curve < 0 || curve >= CURVE_Count) {
+    return false;
+  }
+  unsigned long period = 0;
+  for(int i=0; i<count; i++) {
+    if(steps[i].level < 0 || steps[i].level > LEVEL_MAX) {
+      return false;
+    }
+    period += steps[i].duration;
+  }
+  if(repeat == 0 && period == 0) {
+    // Would repeat forever without time passing
+    return false;
+  }
+
+  MyChannel *channel = &this->channels[pin];
+  for(int i=0; i<count; i++) {
+    channel->steps[i] = steps[i];
+  }
+  channel->stepCount = count;
+  channel->period = period;
+  channel->step = 0;
+  channel->repeat = repeat;
+  channel->curve = curve;
+  channel->from = channel->level;
+  channel->started = millis();
+  channel->finished = false;
+  channel->active = true;
+
+  // Steps without duration take effect at once
+  this->update();
+  if(channel->active && !this->ticking) {
+    this->ticking = true;
+    this->ticker.attach_ms(AO_UPDATE_INTERVAL, &AnalogOutput::onTick, this);
+  }
+  return true;
+}
+
+/**
+ * Current level of an output in 0.1 %
+ */
+int AnalogOutput::level(int pin) {
+  if(pin < 0 || pin > MAX_PINNUMBER) {
+    return 0;
+  }
+  return this->channels[pin].level;
+}
+
+/**
+ * Check if a finished sequence is waiting to be reported
+ */
+bool AnalogOutput::finishedPending() {
+  for(int i=0; i<=MAX_PINNUMBER; i++) {
+    if(this->channels[i].finished) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Take the pin of a finished sequence
+ * Returns false if no sequence has finished
+ */
+bool AnalogOutput::takeFinished(int *pin) {
+  for(int i=0; i<=MAX_PINNUMBER; i++) {
+    if(this->channels[i].finished) {
+      this->channels[i].finished = false;
+      *pin = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Ticker callback
+ * Runs from the SDK timer task, never in parallel with loop()
+ */
+void AnalogOutput::onTick(AnalogOutput *self) {
+  self->update();
+}
+
+/**
+ * Advance all moving outputs to the current time
+ * The timer is stopped when no output is moving.
+ */
+void AnalogOutput::update() {
+  unsigned long now = millis();
+  bool moving = false;
+  for(int i=0; i<=MAX_PINNUMBER; i++) {
+    MyChannel *channel = &this->channels[i];
+    if(!channel->active) continue;
+    while(channel->active) {
+      MyStep *step = &channel->steps[channel->step];
+      unsigned long elapsed = now - channel->started;
+      if(elapsed < step->duration) {
+        channel->level = channel->from + (long)(step->level - channel->from) * (long)elapsed / (long)step->duration;
+        break;
+      }
+      channel->level = step->level;
+      channel->from = step->level;
+      channel->started += step->duration;
+      if(++channel->step < channel->stepCount) continue;
+      channel->step = 0;
+      if(channel->repeat == 0 || --channel->repeat > 0) {
+        if(channel->repeat == 0 && now - channel->started >= channel->period) {
+          // Fell behind by a whole period, skip ahead instead of catching up
+          channel->started = now;
+        }
+        continue;
+      }
+      channel->active = false;
+      channel->finished = true;
+    }
+    this->write(i, channel);
+    moving = moving || channel->active;
+  }
+  if(!moving && this->ticking) {
+    this->ticking = false;
+    this->ticker.detach();
+  }
+}
+
+/**
+ * Write the current level of an output if the duty cycle changed
+ */
+void AnalogOutput::write(int pin, AnalogOutput::MyChannel *channel) {
+  int duty = toDuty(channel->level, channel->curve);
+  if(duty != channel->duty) {
+    channel->duty = duty;
+    analogWrite(pin, duty);
+  }
+}
@@ -0,0 +1,63 @@
+#ifndef AnalogOutput_h
+#define AnalogOutput_h
+#include <Arduino.h>
+#include <Ticker.h>
+#include "myconstants.h"
+
+/*
+ * Timer driven PWM outputs
+ * Levels are given in 0.1 % (0-1000). A fade moves an output to a new
+ * level over a duration, and a sequence is a list of fades played once,
+ * a number of times or until replaced. The timer only runs while an
+ * output is moving.
+ */
+class AnalogOutput {
+  public:
+    enum Curve {
+      CURVE_Linear,
+      CURVE_Gamma,  // Perceived brightness of a LED is linear in the level
+      CURVE_Count
+    };
+    struct MyStep {
+      int           level;    // Target level, 0.1 %
+      unsigned long duration; // ms to reach the level
+    };
+
+    static const int LEVEL_MAX = 1000;
+
+    AnalogOutput();
+    void begin();
+    bool addPin(int pin);
+    bool fade(int pin, int level, unsigned long duration, AnalogOutput::Curve curve);
+    bool play(int pin, const AnalogOutput::MyStep *steps, int count, int repeat, AnalogOutput::Curve curve);
+    int level(int pin);
+    bool finishedPending();
+    bool takeFinished(int *pin);
+
+  private:
+    struct MyChannel {
+      bool          enabled;
+      bool          active;
+      volatile bool finished;   // A sequence has ended, report it
+      Curve         curve;
+      int           level;      // Current level
+      int           from;       // Level at the start of the step
+      int           duty;       // Last written duty cycle
+      unsigned long started;    // millis() at the start of the step
+      MyStep        steps[AO_MAX_STEPS];
+      int           stepCount;
+      unsigned long period;     // ms to play all steps once
+      int           step;
+      int           repeat;     // Plays left, 0 repeats until replaced
+    };
+
+    Ticker ticker;
+    bool ticking;
+    MyChannel channels[MAX_PINNUMBER+1];
+
+    static void onTick(AnalogOutput *self);
+    void update();
+    void write(int pin, MyChannel *channel);
+};
+
+#endif
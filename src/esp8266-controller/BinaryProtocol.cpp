@@ -0,0 +1,96 @@
+/*
+ * BinaryProtocol
+ * Encode and decode the compact binary request and response frames.
+ * Kept apart from the text parser in MessageHandler.
+ *
+ * @author Steinar Thorshaug
+ */
+#include "BinaryProtocol.h"
+
+/**
+ * Write a little-endian 32 bit value
+ */
+static byte *putUint32(byte *p, unsigned long value) {
+  p[0] = value & 0xFF;
+  p[1] = (value >> 8) & 0xFF;
+  p[2] = (value >> 16) & 0xFF;
+  p[3] = (value >> 24) & 0xFF;
+  return p + 4;
+}
+
+/**
+ * Check if a payload is a binary request
+ * The magic byte can never start a text request
+ */
+bool isBinaryRequest(const byte *payload, unsigned int length) {
+  return length > 0 && payload[0] == BINARY_MAGIC;
+}
+
+/**
+ * Decode a binary request frame
+ */
+MessageHandler::ParseError decodeBinaryRequest(const byte *payload, unsigned int length, MessageHandler::MyRequest *parsed) {
+  parsed->req = MessageHandler::REQ_None;
+  parsed->pin = -1;
+  parsed->waittime = 0;
+  parsed->encoding = MessageHandler::ENCODING_Binary;
+  parsed->scheduled = false;
+  parsed->argCount = 0;
+
+  if(length < 2) {
+    return MessageHandler::PARSE_NoRequest;
+  }
+  if(payload[1] == MessageHandler::REQ_None || payload[1] >= MessageHandler::REQ_Count) {
+    return MessageHandler::PARSE_UnknownRequest;
+  }
+  parsed->req = (MessageHandler::MyRequestType)payload[1];
+  if(length < 3) {
+    return MessageHandler::PARSE_NoPin;
+  }
+  if(payload[2] > MAX_PINNUMBER) {
+    return MessageHandler::PARSE_InvalidPin;
+  }
+  parsed->pin = payload[2];
+  if(length < BINARY_REQUEST_SIZE) {
+    return MessageHandler::PARSE_NoWaittime;
+  }
+  unsigned int waittime = payload[3] | (payload[4] << 8);
+  if(waittime > 32767) {
+    return MessageHandler::PARSE_InvalidWaittime;
+  }
+  parsed->waittime = waittime;
+  if(length > BINARY_REQUEST_SIZE) {
+    return MessageHandler::PARSE_TrailingData;
+  }
+  return MessageHandler::PARSE_Ok;
+}
+
+/**
+ * Encode a response frame with the values of the request merged in
+ * Returns the frame length, or 0 if the buffer is too small
+ */
+unsigned int encodeBinaryResponse(byte *frame, unsigned int size, const MessageHandler::MyRequest *req, byte status,
+  const char *text, const IOHandler::MyValues *values, unsigned long time) {
+  int count = values ? values->count : 0;
+  unsigned int textLength = min(strlen(text), (size_t)255);
+  unsigned int needed = 9 + count * 5 + 1 + textLength;
+  if(needed > size) {
+    return 0;
+  }
+
+  byte *p = frame;
+  *p++ = BINARY_MAGIC;
+  *p++ = req->req;
+  *p++ = req->pin < 0 ? 0xFF : req->pin;
+  *p++ = status;
+  p = putUint32(p, time);
+  *p++ = count;
+  for(int i=0; i<count; i++) {
+    *p++ = values->value[i].type;
+    p = putUint32(p, (unsigned long)values->value[i].value);
+  }
+  *p++ = textLength;
+  memcpy(p, text, textLength);
+  p += textLength;
+  return p - frame;
+}
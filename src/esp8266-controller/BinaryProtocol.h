@@ -0,0 +1,28 @@
+#ifndef BinaryProtocol_h
+#define BinaryProtocol_h
+#include <Arduino.h>
+#include "MessageHandler.h"
+
+/*
+ * Compact binary encoding of requests and responses
+ * All multi-byte fields are little-endian.
+ *
+ * Request frame (5 bytes):
+ *   magic, req, pin, waittime(u16)
+ * Response frame (published on <base>/bin/<pin>):
+ *   magic, req, pin, status, time(u32), count, count * (type, value(i32)), textlength, text
+ * status is 1 for success, 0 for failure, 2 if the request queue was full
+ * and 0x80 | ParseError for requests that could not be decoded.
+ */
+const byte BINARY_MAGIC = 0xB5;
+const unsigned int BINARY_REQUEST_SIZE = 5;
+const byte BINARY_STATUS_FAILED = 0x00;
+const byte BINARY_STATUS_OK = 0x01;
+const byte BINARY_STATUS_BUSY = 0x02;
+const byte BINARY_STATUS_PARSE_ERROR = 0x80;
+
+bool isBinaryRequest(const byte *payload, unsigned int length);
+MessageHandler::ParseError decodeBinaryRequest(const byte *payload, unsigned int length, MessageHandler::MyRequest *parsed);
+unsigned int encodeBinaryResponse(byte *frame, unsigned int size, const MessageHandler::MyRequest *req, byte status,
+  const char *text, const IOHandler::MyValues *values, unsigned long time);
+#endif
@@ -0,0 +1,175 @@
+/*
+ * ConnectionManager
+ * Non-blocking WiFi and MQTT connection state machine
+ *
+ * @author Steinar Thorshaug
+ */
+#include <ESP8266WiFi.h>
+#include "ConnectionManager.h"
+#include "Log.h"
+#include "Metrics.h"
+#include "StatusLed.h"
+
+const unsigned long BACKOFF_MIN = 1000; // ms before the first retry
+const unsigned long BACKOFF_MAX = 60000; // Longest ms between two retries
+const unsigned long WIFI_RETRY_TIMEOUT = 30000; // Restart the association if WiFi is not up after this many ms
+const unsigned long WIFI_POLL_INTERVAL = 250; // ms between checks of the WiFi status while it is down
+const unsigned long MQTT_CONNECT_TIMEOUT = 2000; // Limits how long one connect attempt may block
+
+static const char *stateNames[ConnectionManager::CONN_StateCount] = { "wifi", "broker", "connected" };
+static const LedPattern stateLeds[ConnectionManager::CONN_StateCount] = { LED_Offline, LED_Busy, LED_None };
+
+/**
+ * Constructor
+ */
+ConnectionManager::ConnectionManager(PubSubClient *mqtt, const char *subscribeTopic) {
+  this->mqtt = mqtt;
+  this->subscribeTopic = subscribeTopic;
+  this->clientId[0] = 0;
+  this->currentState = CONN_WaitWifi;
+  this->stateSince = 0;
+  this->nextAttempt = 0;
+  this->backoff = BACKOFF_MIN;
+}
+
+/**
+ * Prepare the MQTT client
+ * WiFi.begin() must have been called
+ */
+void ConnectionManager::setup() {
+  snprintf(this->clientId, sizeof(this->clientId), "ESP8266 %lu", (unsigned long)ESP.getChipId());
+  this->mqtt->setSocketTimeout((MQTT_CONNECT_TIMEOUT + 999) / 1000);
+  this->stateSince = millis();
+  statusLedBackground(stateLeds[this->currentState]);
+  METRICS_SET(GAUGE_ConnectionState, this->currentState);
+}
+
+/**
+ * Make progress on the connection
+ * Returns true if the MQTT client is connected
+ */
+bool ConnectionManager::loop() {
+  unsigned long now = millis();
+  bool wifiUp = WiFi.status() == WL_CONNECTED;
+
+  if(!wifiUp && this->currentState != CONN_WaitWifi) {
+    LOG_WARN("WiFi connection lost");
+    METRICS_COUNT(COUNTER_WifiReconnect);
+    this->setState(CONN_WaitWifi);
+  }
+
+  switch(this->currentState) {
+    case CONN_WaitWifi:
+      if(wifiUp) {
+        IPAddress myIp = WiFi.localIP();
+        LOG_INFO("WiFi connected. My ip is %d.%d.%d.%d", myIp[0], myIp[1], myIp[2], myIp[3]);
+        this->backoff = BACKOFF_MIN;
+        // Boards on the same access point see it come back at the same time
+        this->nextAttempt = now + random(BACKOFF_MIN);
+        this->setState(CONN_WaitBroker);
+        break;
+      }
+      if(now - this->stateSince >= WIFI_RETRY_TIMEOUT) {
+        LOG_INFO("WiFi still down, restarting association");
+        WiFi.reconnect();
+        this->stateSince = now;
+      }
+      break;
+    case CONN_WaitBroker:
+      if((long)(now - this->nextAttempt) >= 0) {
+        this->connectBroker();
+      }
+      break;
+    case CONN_Connected:
+      if(!this->mqtt->connected()) {
+        LOG_WARN("MQTT connection lost, rc=%d", this->mqtt->state());
+        this->backoff = BACKOFF_MIN;
+        this->scheduleRetry();
+        this->setState(CONN_WaitBroker);
+      }
+      break;
+    default:
+      break;
+  }
+  return this->currentState == CONN_Connected;
+}
+
+/**
+ * One connection attempt to the broker
+ */
+void ConnectionManager::connectBroker() {
+  LOG_INFO("Attempting MQTT connection...");
+  METRICS_COUNT(COUNTER_MqttReconnect);
+  if(this->mqtt->connect(this->clientId)) {
+    LOG_INFO("MQTT connected");
+    this->mqtt->subscribe(this->subscribeTopic);
+    this->backoff = BACKOFF_MIN;
+    this->setState(CONN_Connected);
+    return;
+  }
+  METRICS_COUNT(COUNTER_MqttConnectFailed);
+  this->scheduleRetry();
+  LOG_WARN("MQTT connection failed, rc=%d try again in %lu ms", this->mqtt->state(), this->nextAttempt - millis());
+}
+
+/**
+ * Set the time of the next attempt and double the backoff
+ * The delay is drawn from [backoff/2, backoff) to spread out a fleet
+ */
+void ConnectionManager::scheduleRetry() {
+  unsigned long delay = this->backoff / 2 + random(this->backoff / 2);
+  this->nextAttempt = millis() + delay;
+  this->backoff = min(this->backoff * 2, BACKOFF_MAX);
+}
+
+/**
+ * Change state and report the transition
+ */
+void ConnectionManager::setState(ConnectionState state) {
+  if(state == this->currentState) {
+    return;
+  }
+  LOG_DEBUG("Connection %s -> %s", stateNames[this->currentState], stateNames[state]);
+  this->currentState = state;
+  this->stateSince = millis();
+  statusLedBackground(stateLeds[state]);
+  METRICS_COUNT(COUNTER_ConnectionChange);
+  METRICS_SET(GAUGE_ConnectionState, state);
+}
+
+/**
+ * Current connection state
+ */
+ConnectionManager::ConnectionState ConnectionManager::state() {
+  return this->currentState;
+}
+
+/**
+ * Check if WiFi is associated and has an address
+ */
+bool ConnectionManager::wifiConnected() {
+  return this->currentState != CONN_WaitWifi;
+}
+
+/**
+ * Milliseconds until loop() has something to do
+ */
+unsigned long ConnectionManager::millisToNextEvent() {
+  unsigned long now = millis();
+  switch(this->currentState) {
+    case CONN_WaitWifi:
+      return WIFI_POLL_INTERVAL - (now - this->stateSince) % WIFI_POLL_INTERVAL;
+    case CONN_WaitBroker:
+      return (long)(this->nextAttempt - now) > 0 ? this->nextAttempt - now : 0;
+    default:
+      // Losing the connection is seen by mqtt.loop() when the socket closes
+      return (unsigned long)-1;
+  }
+}
+
+/**
+ * Name of a connection state
+ */
+const char *ConnectionManager::stateName(ConnectionState state) {
+  return state < CONN_StateCount ? stateNames[state] : "";
+}
@@ -0,0 +1,43 @@
+#ifndef ConnectionManager_h
+#define ConnectionManager_h
+#include <Arduino.h>
+#include <PubSubClient.h>
+#include "myconstants.h"
+
+/*
+ * Keeps WiFi and the MQTT broker connected without blocking the main loop
+ * Failed MQTT connects are retried with exponential backoff and jitter, so
+ * a fleet of devices does not reconnect to the broker all at once.
+ */
+class ConnectionManager {
+  public:
+    enum ConnectionState {
+      CONN_WaitWifi,    // Waiting for the WiFi station to associate
+      CONN_WaitBroker,  // WiFi is up, waiting before the next MQTT attempt
+      CONN_Connected,   // MQTT is connected
+      CONN_StateCount
+    };
+
+    ConnectionManager(PubSubClient *mqtt, const char *subscribeTopic);
+    void setup();
+    bool loop();
+    ConnectionState state();
+    bool wifiConnected();
+    unsigned long millisToNextEvent();
+    static const char *stateName(ConnectionState state);
+
+  private:
+    PubSubClient *mqtt;
+    const char *subscribeTopic;
+    char clientId[24];
+    ConnectionState currentState;
+    unsigned long stateSince;
+    unsigned long nextAttempt;
+    unsigned long backoff;
+
+    void setState(ConnectionState state);
+    void connectBroker();
+    void scheduleRetry();
+};
+
+#endif
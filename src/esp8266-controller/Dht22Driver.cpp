@@ -0,0 +1,63 @@
+/*
+ * Dht22Driver
+ * DHT22 through the Adafruit DHT library
+ *
+ * @author Steinar Thorshaug
+ */
+#include "Dht22Driver.h"
+#ifdef EXTLIB_DHT22
+#include <new>
+
+const unsigned long DHT22_MIN_INTERVAL = 2000; // The DHT22 gives a new reading every 2 seconds
+
+/**
+ * Constructor
+ */
+Dht22Driver::Dht22Driver() {
+  this->dht = NULL;
+}
+
+/**
+ * Construct the library object in the driver storage and start it
+ */
+bool Dht22Driver::begin(int pin) {
+  this->dht = new (this->storage) DHT(pin, DHT22);
+  this->dht->begin();
+  return true;
+}
+
+/**
+ * The DHT22 converts when it is read
+ */
+unsigned long Dht22Driver::startSample() {
+  return 0;
+}
+
+/**
+ * Read temperature and humidity
+ */
+bool Dht22Driver::readResult(IOHandler::MyValues *values) {
+  float t = this->dht->readTemperature();
+  float h = this->dht->readHumidity();
+  if(isnan(t) || isnan(h)) {
+    return false;
+  }
+  IOHandler::addValue(values, IOHandler::VALUE_Temperature, lroundf(t * 10));
+  IOHandler::addValue(values, IOHandler::VALUE_Humidity, lroundf(h * 10));
+  return true;
+}
+
+/**
+ * Shortest ms between two readings
+ */
+unsigned long Dht22Driver::minInterval() {
+  return DHT22_MIN_INTERVAL;
+}
+
+/**
+ * Sensor name for logging
+ */
+const char *Dht22Driver::name() {
+  return "DHT22";
+}
+#endif
@@ -0,0 +1,30 @@
+#ifndef Dht22Driver_h
+#define Dht22Driver_h
+#include "SensorDriver.h"
+
+class Dht22Driver;
+
+#ifdef EXTLIB_DHT22
+#include "DHT.h"
+
+/*
+ * DHT22 temperature and humidity sensor
+ * The transfer is bit-banged by the Adafruit library and blocks for a
+ * few ms in readResult().
+ */
+class Dht22Driver : public SensorDriver {
+  public:
+    Dht22Driver();
+    bool begin(int pin);
+    unsigned long startSample();
+    bool readResult(IOHandler::MyValues *values);
+    unsigned long minInterval();
+    const char *name();
+
+  private:
+    alignas(DHT) uint8_t storage[sizeof(DHT)]; // The DHT object, constructed in begin()
+    DHT *dht;
+};
+#endif
+
+#endif
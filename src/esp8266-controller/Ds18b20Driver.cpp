@@ -0,0 +1,69 @@
+/*
+ * Ds18b20Driver
+ * DS18B20 through the OneWire library
+ *
+ * @author Steinar Thorshaug
+ */
+#include "Ds18b20Driver.h"
+#ifdef EXTLIB_ONEWIRE
+
+const byte DS18B20_CONVERT = 0x44;
+const byte DS18B20_READ_SCRATCHPAD = 0xBE;
+const unsigned long DS18B20_CONVERSION_TIME = 750; // ms at 12 bit resolution
+const int16_t DS18B20_POWER_ON_VALUE = 0x0550;     // 85 degC, read when no conversion was done
+
+/**
+ * Attach to the bus and check that a device answers
+ */
+bool Ds18b20Driver::begin(int pin) {
+  this->bus.begin(pin);
+  return this->bus.reset();
+}
+
+/**
+ * Start a temperature conversion
+ */
+unsigned long Ds18b20Driver::startSample() {
+  this->bus.reset();
+  this->bus.skip();
+  this->bus.write(DS18B20_CONVERT);
+  return DS18B20_CONVERSION_TIME;
+}
+
+/**
+ * Read the converted temperature from the scratchpad
+ */
+bool Ds18b20Driver::readResult(IOHandler::MyValues *values) {
+  byte scratchpad[9];
+  if(!this->bus.reset()) {
+    return false;
+  }
+  this->bus.skip();
+  this->bus.write(DS18B20_READ_SCRATCHPAD);
+  this->bus.read_bytes(scratchpad, sizeof(scratchpad));
+  if(OneWire::crc8(scratchpad, 8) != scratchpad[8]) {
+    return false;
+  }
+  int16_t raw = (int16_t)(scratchpad[1] << 8 | scratchpad[0]);
+  if(raw == DS18B20_POWER_ON_VALUE) {
+    return false;
+  }
+  // 1/16 degC to 0.1 degC
+  IOHandler::addValue(values, IOHandler::VALUE_Temperature, ((long)raw * 10 + (raw < 0 ? -8 : 8)) / 16);
+  return true;
+}
+
+/**
+ * Shortest ms between two readings
+ */
+unsigned long Ds18b20Driver::minInterval() {
+  return DS18B20_CONVERSION_TIME;
+}
+
+/**
+ * Sensor name for logging
+ */
+const char *Ds18b20Driver::name() {
+  return "DS18B20";
+}
+#endif
@@ -0,0 +1,27 @@
+#ifndef Ds18b20Driver_h
+#define Ds18b20Driver_h
+#include "SensorDriver.h"
+
+class Ds18b20Driver;
+
+#ifdef EXTLIB_ONEWIRE
+#include <OneWire.h>
+
+/*
+ * DS18B20 temperature sensor, alone on a 1-Wire bus
+ * The conversion takes up to 750 ms, the bus is free in the meantime.
+ */
+class Ds18b20Driver : public SensorDriver {
+  public:
+    bool begin(int pin);
+    unsigned long startSample();
+    bool readResult(IOHandler::MyValues *values);
+    unsigned long minInterval();
+    const char *name();
+
+  private:
+    OneWire bus;
+};
+#endif
+
+#endif
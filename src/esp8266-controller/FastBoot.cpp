@@ -0,0 +1,380 @@
+/*
+ * FastBoot
+ * Cache the last good network configuration and clock in RTC memory,
+ * and report how long each phase of the boot took.
+ *
+ * @author Steinar Thorshaug
+ */
+#include <ESP8266WiFi.h>
+#include "FastBoot.h"
+#include "TimeController.h"
+#include "JsonWriter.h"
+#include "Log.h"
+#ifdef FASTBOOT_FLASH
+#include <LittleFS.h>
+#endif
+extern "C" {
+#include <user_interface.h>
+#include <lwip/netif.h>
+#include <lwip/dhcp.h>
+}
+
+const uint32_t FASTBOOT_MAGIC = 0x46420002;          // Changes with the cache layout
+const uint32_t FASTBOOT_RTC_BLOCK = 0;               // First 4 byte block of RTC user memory
+const unsigned long FASTBOOT_CONNECT_TIMEOUT = 5000; // ms before the cached network is given up
+const unsigned long FASTBOOT_SAVE_INTERVAL = 10000;  // ms between saves of the clock
+const uint32_t FASTBOOT_MIN_LEASE = 60;              // s of DHCP lease that must be left to reuse the cached address
+#ifdef FASTBOOT_FLASH
+const char *FASTBOOT_FILE = "/fastboot.bin";
+#endif
+
+/*
+ * Where the cache was restored from, reported in the boot times
+ */
+enum FastBootSource {
+  FASTBOOT_None,
+  FASTBOOT_Rtc,
+  FASTBOOT_Flash
+};
+
+struct FastBootNetwork {
+  uint32_t ip;
+  uint32_t gateway;
+  uint32_t mask;
+  uint32_t dns;
+  uint32_t leaseLeft; // s of the DHCP lease left when the cache was saved
+  uint8_t  bssid[6];
+  uint8_t  channel;
+  uint8_t  valid;
+};
+
+struct FastBootCache {
+  uint32_t        crc;       // CRC-32 of the rest of the cache
+  uint32_t        magic;
+  FastBootNetwork network;
+  int32_t         driftPpb;
+  uint32_t        rtcTicks;  // system_get_rtc_time() when the cache was saved
+  int64_t         utcMillis; // 0 if the clock was not synced
+};
+
+static_assert(sizeof(FastBootCache) % 4 == 0, "RTC memory is accessed in 4 byte blocks");
+static_assert(sizeof(FastBootCache) <= 512 - FASTBOOT_RTC_BLOCK * 4, "FastBootCache does not fit in RTC user memory");
+
+static FastBootCache cache;
+static FastBootSource source = FASTBOOT_None;
+static const char *wifiSsid = NULL;
+static const char *wifiPassword = NULL;
+static bool cachedBegin = false;  // The current association uses the cached network
+static bool cachedAddress = false; // The address is the cached one, DHCP is not running
+static uint32_t leaseSeconds = 0;  // Lease left at leaseFrom
+static unsigned long leaseFrom = 0;
+static bool lastWifi = false;
+static unsigned long beganAt = 0;
+static unsigned long lastSave = 0;
+// millis() when each boot phase completed, 0 until then
+static unsigned long setupAt = 0;
+static unsigned long wifiAt = 0;
+static unsigned long mqttAt = 0;
+static unsigned long timeAt = 0;
+
+/**
+ * CRC-32 of a block of memory
+ */
+static uint32_t crc32(const uint8_t *data, size_t length) {
+  uint32_t crc = 0xFFFFFFFF;
+  for(size_t i=0; i<length; i++) {
+    crc ^= data[i];
+    for(int bit=0; bit<8; bit++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+  }
+  return ~crc;
+}
+
+/**
+ * CRC-32 of a cache, not including the crc field
+ */
+static uint32_t cacheCrc(const FastBootCache *stored) {
+  return crc32((const uint8_t*)stored + sizeof(stored->crc), sizeof(*stored) - sizeof(stored->crc));
+}
+
+/**
+ * Check that a cache was written by this firmware and is intact
+ */
+static bool cacheValid(const FastBootCache *stored) {
+  return stored->magic == FASTBOOT_MAGIC && stored->crc == cacheCrc(stored);
+}
+
+/**
+ * Seconds left of the DHCP lease of the current address
+ * While DHCP runs the lease is read from lwIP, since it is renewed. The
+ * cached address has no DHCP, and its lease counts down from boot.
+ */
+static uint32_t leaseLeft() {
+  unsigned long now = millis();
+  if(!cachedAddress && WiFi.status() == WL_CONNECTED && netif_default) {
+    struct dhcp *dhcp = netif_dhcp_data(netif_default);
+    leaseSeconds = 0;
+    if(dhcp && dhcp->t0_timeout > dhcp->lease_used) {
+      leaseSeconds = (uint32_t)(dhcp->t0_timeout - dhcp->lease_used) * DHCP_COARSE_TIMER_SECS;
+    }
+    leaseFrom = now;
+  }
+  uint32_t used = (now - leaseFrom) / 1000;
+  return leaseSeconds > used ? leaseSeconds - used : 0;
+}
+
+/**
+ * us the RTC timer counted since the cache was saved
+ */
+static uint64_t microsSinceSave() {
+  uint32_t ticks = system_get_rtc_time() - cache.rtcTicks;
+  return ((uint64_t)ticks * system_rtc_clock_cali_proc()) >> 12; // Calibration is Q12
+}
+
+#ifdef FASTBOOT_FLASH
+/**
+ * Read the cache from flash
+ */
+static bool readFlash(FastBootCache *stored) {
+  if(!LittleFS.begin()) {
+    return false;
+  }
+  File file = LittleFS.open(FASTBOOT_FILE, "r");
+  if(!file) {
+    return false;
+  }
+  bool complete = file.read((uint8_t*)stored, sizeof(*stored)) == sizeof(*stored);
+  file.close();
+  return complete && cacheValid(stored);
+}
+
+/**
+ * Write the cache to flash if the network changed
+ * The clock is not useful after a power loss, so it does not cause writes.
+ */
+static void writeFlash() {
+  FastBootCache stored;
+  bool missing = !readFlash(&stored);
+  // The lease is not used after a power loss, so it does not cause writes either
+  stored.network.leaseLeft = cache.network.leaseLeft;
+  if(!missing && memcmp(&stored.network, &cache.network, sizeof(cache.network)) == 0) {
+    return;
+  }
+  File file = LittleFS.open(FASTBOOT_FILE, "w");
+  if(!file) {
+    LOG_WARN("FastBoot: Could not write %s", FASTBOOT_FILE);
+    return;
+  }
+  file.write((const uint8_t*)&cache, sizeof(cache));
+  file.close();
+}
+#endif
+
+/**
+ * Write the cache with the current clock to RTC memory
+ */
+static void saveRtc() {
+  long driftPpb = cache.driftPpb;
+  int64_t utcMillis;
+  if(getTimeSnapshot(&utcMillis, &driftPpb)) {
+    cache.utcMillis = utcMillis;
+  } else {
+    cache.utcMillis = 0;
+  }
+  cache.rtcTicks = system_get_rtc_time();
+  cache.network.leaseLeft = leaseLeft();
+  cache.driftPpb = driftPpb;
+  cache.magic = FASTBOOT_MAGIC;
+  cache.crc = cacheCrc(&cache);
+  ESP.rtcUserMemoryWrite(FASTBOOT_RTC_BLOCK, (uint32_t*)&cache, sizeof(cache));
+  lastSave = millis();
+}
+
+/**
+ * Remember the network of the current connection
+ */
+static void saveNetwork() {
+  FastBootNetwork *network = &cache.network;
+  memset(network, 0, sizeof(*network));
+  network->ip = WiFi.localIP();
+  network->gateway = WiFi.gatewayIP();
+  network->mask = WiFi.subnetMask();
+  network->dns = WiFi.dnsIP();
+  memcpy(network->bssid, WiFi.BSSID(), sizeof(network->bssid));
+  network->channel = WiFi.channel();
+  network->valid = 1;
+  saveRtc();
+#ifdef FASTBOOT_FLASH
+  writeFlash();
+#endif
+}
+
+/**
+ * Associate the normal way, with a scan and DHCP
+ * The cache is forgotten if it never gave a connection.
+ */
+static void beginWithoutCache() {
+  LOG_WARN("FastBoot: Cached network failed, scanning");
+  cachedBegin = false;
+  cachedAddress = false;
+  if(!wifiAt) {
+    cache.network.valid = 0;
+    saveRtc();
+#ifdef FASTBOOT_FLASH
+    LittleFS.remove(FASTBOOT_FILE);
+#endif
+  }
+  WiFi.config(IPAddress(0u), IPAddress(0u), IPAddress(0u));
+  WiFi.begin(wifiSsid, wifiPassword);
+  beganAt = millis();
+}
+
+/**
+ * Get an address by DHCP when the lease of the cached one has run out
+ * The association starts over, so the new address is saved when it is up.
+ */
+static void renewAddress() {
+  LOG_INFO("FastBoot: Lease of the cached address expired, using DHCP");
+  cachedBegin = false;
+  cachedAddress = false;
+  WiFi.config(IPAddress(0u), IPAddress(0u), IPAddress(0u));
+  WiFi.begin(wifiSsid, wifiPassword, cache.network.channel, cache.network.bssid);
+  beganAt = millis();
+}
+
+/**
+ * Read the cache, from RTC memory or else from flash
+ * Call first in setup(), the time of the call is the boot time. The lease
+ * of the cached address is reduced by the time the board was away: the
+ * RTC timer counts through deep sleep, after other resets the cache is at
+ * most FASTBOOT_SAVE_INTERVAL old, and after a power loss it is unknown.
+ */
+void fastBootLoad() {
+  FastBootCache stored;
+  setupAt = millis();
+  memset(&cache, 0, sizeof(cache));
+  if(ESP.rtcUserMemoryRead(FASTBOOT_RTC_BLOCK, (uint32_t*)&stored, sizeof(stored)) && cacheValid(&stored)) {
+    cache = stored;
+    source = FASTBOOT_Rtc;
+#ifdef FASTBOOT_FLASH
+  } else if(readFlash(&stored)) {
+    cache = stored;
+    cache.utcMillis = 0;
+    source = FASTBOOT_Flash;
+#endif
+  }
+  leaseFrom = setupAt;
+  leaseSeconds = 0;
+  if(source == FASTBOOT_Rtc) {
+    uint64_t away = FASTBOOT_SAVE_INTERVAL;
+    if(ESP.getResetInfoPtr()->reason == REASON_DEEP_SLEEP_AWAKE) {
+      away = microsSinceSave() / 1000;
+    }
+    if(cache.network.leaseLeft > away / 1000) {
+      leaseSeconds = cache.network.leaseLeft - (uint32_t)(away / 1000);
+    }
+  }
+  if(cache.network.valid) {
+    LOG_INFO("FastBoot: Cached network on channel %d, %lu s of lease left", cache.network.channel, (unsigned long)leaseSeconds);
+  }
+}
+
+/**
+ * Start the WiFi association
+ * With a cached network the scan is skipped, and DHCP too while the lease
+ * of the cached address lasts. If that does not connect within
+ * FASTBOOT_CONNECT_TIMEOUT, fastBootLoop() starts over without the cache.
+ */
+void fastBootBegin(const char *ssid, const char *password) {
+  wifiSsid = ssid;
+  wifiPassword = password;
+  WiFi.persistent(false); // The SDK would otherwise write the configuration to flash on every begin
+  WiFi.mode(WIFI_STA);
+  beganAt = millis();
+  if(!cache.network.valid) {
+    WiFi.begin(ssid, password);
+    return;
+  }
+  FastBootNetwork *network = &cache.network;
+  cachedBegin = true;
+  if(leaseLeft() >= FASTBOOT_MIN_LEASE) {
+    cachedAddress = true;
+    WiFi.config(IPAddress(network->ip), IPAddress(network->gateway), IPAddress(network->mask), IPAddress(network->dns));
+  }
+  WiFi.begin(ssid, password, network->channel, network->bssid);
+}
+
+/**
+ * Restore the clock and drift estimate
+ * Call after initTimeController(). The RTC timer only keeps counting
+ * through deep sleep, so the clock is restored only after a wake.
+ */
+void fastBootRestoreTime() {
+  int64_t utcMillis = 0;
+  if(source == FASTBOOT_None) {
+    return;
+  }
+  if(source == FASTBOOT_Rtc && cache.utcMillis > 0 && ESP.getResetInfoPtr()->reason == REASON_DEEP_SLEEP_AWAKE) {
+    utcMillis = cache.utcMillis + (int64_t)(microsSinceSave() / 1000);
+  }
+  restoreTimeSnapshot(utcMillis, cache.driftPpb);
+}
+
+/**
+ * Record the boot phases, keep the cache up to date, and fall back to a
+ * normal association if the cached network does not work
+ */
+void fastBootLoop(bool wifiConnected, bool mqttConnected) {
+  unsigned long now = millis();
+  if(wifiConnected && !lastWifi) {
+    if(!wifiAt) {
+      wifiAt = now;
+    }
+    saveNetwork();
+  }
+  if(!wifiConnected && cachedBegin && (lastWifi || now - beganAt >= FASTBOOT_CONNECT_TIMEOUT)) {
+    // The cached BSSID and address may be stale, so do not keep them after a loss either
+    beginWithoutCache();
+  }
+  lastWifi = wifiConnected;
+  if(wifiConnected && cachedAddress && leaseLeft() == 0) {
+    renewAddress();
+  }
+  if(mqttConnected && !mqttAt) {
+    mqttAt = now;
+  }
+  if(!timeAt && getCurrentUtcMillis() != 0) {
+    timeAt = now;
+  }
+  if(now - lastSave >= FASTBOOT_SAVE_INTERVAL) {
+    saveRtc();
+  }
+}
+
+/**
+ * Milliseconds until fastBootLoop() has something to do
+ */
+unsigned long millisToNextFastBootEvent() {
+  unsigned long now = millis();
+  unsigned long wait = FASTBOOT_SAVE_INTERVAL - min(now - lastSave, FASTBOOT_SAVE_INTERVAL);
+  if(cachedBegin && !lastWifi) {
+    wait = min(wait, FASTBOOT_CONNECT_TIMEOUT - min(now - beganAt, FASTBOOT_CONNECT_TIMEOUT));
+  }
+  return wait;
+}
+
+/**
+ * Add the boot phase times in ms as "boot":[setup,wifi,mqtt,time,cache]
+ * Phases not completed yet are 0. cache is 0 for none, 1 for RTC memory
+ * and 2 for flash.
+ */
+void fastBootWriteJson(JsonWriter *json) {
+  json->beginArray("boot");
+  json->addUnsigned(NULL, setupAt);
+  json->addUnsigned(NULL, wifiAt);
+  json->addUnsigned(NULL, mqttAt);
+  json->addUnsigned(NULL, timeAt);
+  json->addInt(NULL, source);
+  json->endArray();
+}
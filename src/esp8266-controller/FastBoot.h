@@ -0,0 +1,21 @@
+#ifndef FastBoot_h
+#define FastBoot_h
+#include <Arduino.h>
+#include "myconstants.h"
+
+class JsonWriter;
+
+/*
+ * Fast reconnect after a reboot or wake
+ * The WiFi channel, BSSID and IP configuration of the last connection,
+ * and the clock, are kept in RTC memory. WiFi then skips the scan and
+ * DHCP, and timestamps are valid before the first NTP reply. With
+ * FASTBOOT_FLASH the network part is also kept in flash.
+ */
+void fastBootLoad();
+void fastBootBegin(const char *ssid, const char *password);
+void fastBootRestoreTime();
+void fastBootLoop(bool wifiConnected, bool mqttConnected);
+unsigned long millisToNextFastBootEvent();
+void fastBootWriteJson(JsonWriter *json);
+#endif
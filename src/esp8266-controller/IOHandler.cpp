@@ -1,152 +1,504 @@
 #include "IOHandler.h"
+#include "PinMap.h"
+#include "SensorRegistry.h"
+#include "SensorDriver.h"
+#include "Log.h"
+#include "Metrics.h"
+
+/*
+ * Names and number of decimals for IOHandler::ValueType
+ */
+static const char *valueNames[] = { "temp", "hum", "age", "level", "count", "ai", "min", "max", "mean", "jitter", "cpu", "out" };
+static const int valueDecimalCount[] = { 1, 1, 0, 0, 0, 2, 2, 2, 2, 0, 0, 1 };
+
+/*
+ * ReadValues handler of each IOHandler::PinConfig
+ */
+const IOHandler::ReadHandler IOHandler::readHandlers[PINCONFIG_Count] = {
+  &IOHandler::readUnsupported, // PINCONFIG_None
+  &IOHandler::readDigital,     // PINCONFIG_DI
+  &IOHandler::readUnsupported, // PINCONFIG_DO
+  &IOHandler::readAnalog,      // PINCONFIG_AI
+  &IOHandler::readOutput,      // PINCONFIG_AO
+  &IOHandler::readSample,      // PINCONFIG_DHT22
+  &IOHandler::readSample,      // PINCONFIG_DS18B20
+  &IOHandler::readSample       // PINCONFIG_SHT31
+};
+
+/**
+ * ms between background samples of a sensor
+ */
+static unsigned long sampleInterval(SensorDriver *driver) {
+  return max(SAMPLE_INTERVAL, driver->minInterval());
+}
 
 IOHandler::IOHandler() {
   // Initialize values
-  for(int i=0; i<MAX_PINNUMBER; i++) {
-    this->myIOs[i].active = false;
-#ifdef EXTLIB_DHT22
-    this->dht22[i] = NULL;
-#endif
+  for(int i=0; i<=MAX_PINNUMBER; i++) {
+    this->pulses[i].active = false;
+    this->pulses[i].finished = false;
+    this->samples[i].valid = false;
+    this->samples[i].pending = false;
+    this->samples[i].ready = false;
+    this->samples[i].converting = false;
+    this->samples[i].readyAt = 0;
+    this->samples[i].sampledAt = 0;
+    this->samples[i].lastAttempt = 0;
+    this->inputs[i].owner = this;
+    this->inputs[i].pin = i;
+    this->inputs[i].level = 0;
+    this->inputs[i].lastEdge = 0;
+    this->inputs[i].count = 0;
   }
+  this->nextSamplePin = 0;
+  this->droppedEdges = 0;
+  this->reportedDroppedEdges = 0;
 }
 
 /**
- * Configure a specific pin
- * Must be performed prior to running
+ * Configuration of a pin from PIN_MAP
  */
-bool IOHandler::assignPinConfiguration(int pin, IOHandler::PinConfig config) {
+IOHandler::PinConfig IOHandler::pinConfig(int pin) {
   if(pin < 0 || pin > MAX_PINNUMBER) {
-    Serial.print("Invalid pin number ");
-    Serial.println(pin);
-    return false;
-  }
-  if(this->myIOs[pin].active) {
-    Serial.print("Pin ");
-    Serial.print(pin);
-    Serial.println(" is already taken");
-    return false;
+    return PINCONFIG_None;
   }
-  this->myIOs[pin].active = true;
-  this->myIOs[pin].config = config;
+  return PinConfigs::configs[pin];
 }
 
 /**
- * Configure all pins
+ * Configure all pins in PIN_MAP
  */
 void IOHandler::setup() {
-  for(int i=0; i<MAX_PINNUMBER; i++) {
-    if(!this->myIOs[i].active) continue;
-    Serial.print("Setting pin ");
-    Serial.print(i);
-    switch(this->myIOs[i].config) {
+  for(int n=0; n<PIN_MAP_SIZE; n++) {
+    int i = pinMap[n].pin;
+    SensorDriver *driver;
+    switch(pinMap[n].config) {
       case PINCONFIG_DO:
-        Serial.println(" as output");
+        LOG_INFO("Setting pin %d as output", i);
         pinMode(i, OUTPUT);
         digitalWrite(i, OUTPUT_LOW);
         break;
       case PINCONFIG_DI:
-        Serial.println(" as input");
+        LOG_INFO("Setting pin %d as input", i);
         pinMode(i, INPUT);
+        this->inputs[i].level = digitalRead(i);
+        this->inputs[i].lastEdge = micros();
+        attachInterruptArg(digitalPinToInterrupt(i), &IOHandler::onInputEdge, &this->inputs[i], CHANGE);
+        break;
+      case PINCONFIG_AI:
+        LOG_INFO("Setting pin %d as analog input (A0)", i);
+        this->analogInput.begin(i);
+        break;
+      case PINCONFIG_AO:
+        LOG_INFO("Setting pin %d as PWM output", i);
+        this->analogOutput.begin();
+        this->analogOutput.addPin(i);
         break;
-#ifdef EXTLIB_DHT22
       case PINCONFIG_DHT22:
-        Serial.println(" as DHT22");
-        this->dht22[i] = new DHT(i, DHT22);
-        this->dht22[i]->begin();
+      case PINCONFIG_DS18B20:
+      case PINCONFIG_SHT31:
+        driver = sensorRegistryAttach(i, pinMap[n].config);
+        if(driver) {
+          LOG_INFO("Setting pin %d as %s", i, driver->name());
+          // Take the first sample at once
+          this->samples[i].lastAttempt = millis() - sampleInterval(driver);
+        }
         break;
-#endif
       default:
-        // todo Analog IO not supported yet
-        Serial.println(" nothing. Not supported");
+        LOG_WARN("Setting pin %d as nothing. Not supported", i);
         break;
     }
   }
 }
 
-/*
- * Flash a led a given number of times
- */
-void IOHandler::flashLed(int ledPin, int numberOfTimes, int waitTime) {
-  int i;
-  for(i=0; i<numberOfTimes; i++) {
-    digitalWrite(ledPin, OUTPUT_HIGH);
-    delay(waitTime);
-    digitalWrite(ledPin, OUTPUT_LOW);
-    if(i<numberOfTimes-1) {
-      delay(waitTime);
-    }
-  }
-}
-
 /**
  * Perform a ToggleOnOff command
+ * Sets the pin high and returns immediately. The pin is released by loop()
+ * when the wait time has passed. A new pulse on a busy pin restarts it.
  */
 bool IOHandler::runToggleOnOff(int pin, int waittime, char *text) {
-  if(!this->checkPinConfig(pin, PINCONFIG_DO)) {
+  if(pinConfig(pin) != PINCONFIG_DO) {
     strcpy(text, "Pin is not configured for output");
     return false;
   }
-  digitalWrite(pin, OUTPUT_HIGH);
-  delay(waittime);
-  digitalWrite(pin, OUTPUT_LOW);
-  strcpy(text, "");
+  MyPulse *pulse = &this->pulses[pin];
+  pulse->started = millis();
+  pulse->duration = waittime;
+  pulse->finished = false;
+  if(!pulse->active) {
+    pulse->active = true;
+    digitalWrite(pin, OUTPUT_HIGH);
+  }
+  strcpy(text, "Pulse started");
   return true;
 }
 
 /**
- * Perform a read values command
+ * Perform a Fade command
+ * The output is moved by a timer, and IOEVENT_OutputFinished is reported
+ * when the level is reached.
  */
-bool IOHandler::runReadValues(int pin, char *text, char *jsonValue) {
-  if(this->checkPinConfig(pin, PINCONFIG_DI)) {
-    strcpy(text, "DI reading not supported");
+bool IOHandler::runFade(int pin, int level, unsigned long duration, AnalogOutput::Curve curve, char *text) {
+  if(pinConfig(pin) != PINCONFIG_AO) {
+    strcpy(text, "Pin is not configured for analog output");
     return false;
   }
-#ifdef EXTLIB_DHT22
-  else if(this->checkPinConfig(pin, PINCONFIG_DHT22)) {
-    return this->readDht22(pin, text, jsonValue);
-  }
-#endif
-  else {
-    strcpy(text, "Pin does not support readings");
+  if(!this->analogOutput.fade(pin, level, duration, curve)) {
+    strcpy(text, "Invalid level or curve");
     return false;
   }
+  strcpy(text, "Fade started");
+  return true;
 }
 
 /**
- * Perform an on-demand DHT22 reading
+ * Perform a Sequence command
+ * IOEVENT_OutputFinished is reported when the last repeat has been played.
  */
-bool IOHandler::readDht22(int pin, char *text, char *jsonValue) {
-#ifdef EXTLIB_DHT22
-  if(!this->checkPinConfig(pin, PINCONFIG_DHT22)) {
-    strcpy(text, "Pin is not configured for DHT22");
+bool IOHandler::runSequence(int pin, const AnalogOutput::MyStep *steps, int count, int repeat, AnalogOutput::Curve curve, char *text) {
+  if(pinConfig(pin) != PINCONFIG_AO) {
+    strcpy(text, "Pin is not configured for analog output");
     return false;
   }
-  DHT *dht = this->dht22[pin];
-  float t = dht->readTemperature();
-  float h = dht->readHumidity();
-  char temperature[10], humidity[10];
-  if(isnan(t) || isnan(h)) {
-    strcpy(text, "Temperature/Humidity was NaN");
-    strcpy(jsonValue, "");
+  if(!this->analogOutput.play(pin, steps, count, repeat, curve)) {
+    strcpy(text, "Invalid sequence");
     return false;
   }
-  dtostrf(t, 5, 1, temperature);
-  dtostrf(h, 5, 1, humidity);
-  snprintf (jsonValue, 50, "\"temp\":%s,\"hum\":%s", temperature, humidity);
-  strcpy(text, "");
+  strcpy(text, "Sequence started");
   return true;
-#else
-  strcpy(text, "DHT22 not enabled");
+}
+
+/**
+ * Interrupt handler for digital inputs
+ * Edges within DI_DEBOUNCE_TIME of the last accepted edge are ignored.
+ */
+void IRAM_ATTR IOHandler::onInputEdge(void *arg) {
+  MyInput *input = (MyInput*)arg;
+  unsigned long now = micros();
+  int level = digitalRead(input->pin);
+  if(level == input->level || now - input->lastEdge < DI_DEBOUNCE_TIME) {
+    return;
+  }
+  input->owner->recordEdge(input, level, now);
+}
+
+/**
+ * Accept an input edge and queue it for the main loop
+ * Runs in interrupt context, or from loop() with interrupts disabled
+ */
+void IRAM_ATTR IOHandler::recordEdge(IOHandler::MyInput *input, int level, unsigned long now) {
+  MyEdge edge;
+  input->level = level;
+  input->lastEdge = now;
+  if(level) {
+    input->count++;
+  }
+  edge.pin = input->pin;
+  edge.level = level;
+  edge.count = input->count;
+  edge.micros = now;
+  if(!this->edges.push(edge)) {
+    this->droppedEdges++;
+  }
+}
+
+/**
+ * Catch inputs that settled at another level while edges were ignored
+ */
+void IOHandler::checkInputs() {
+  for(int n=0; n<PIN_MAP_SIZE; n++) {
+    if(pinMap[n].config != PINCONFIG_DI) continue;
+    int i = pinMap[n].pin;
+    MyInput *input = &this->inputs[i];
+    noInterrupts();
+    unsigned long now = micros();
+    int level = digitalRead(i);
+    if(level != input->level && now - input->lastEdge >= DI_DEBOUNCE_TIME) {
+      this->recordEdge(input, level, now);
+    }
+    interrupts();
+  }
+  if(this->droppedEdges != this->reportedDroppedEdges) {
+    this->reportedDroppedEdges = this->droppedEdges;
+    LOG_WARN("Input queue full, %lu edges lost", this->reportedDroppedEdges);
+  }
+}
+
+/**
+ * Release outputs with an expired pulse and take background samples
+ * At most one sensor is read per call, to keep the loop time bounded.
+ */
+void IOHandler::loop() {
+  unsigned long now = millis();
+  for(int i=0; i<=MAX_PINNUMBER; i++) {
+    MyPulse *pulse = &this->pulses[i];
+    if(!pulse->active) continue;
+    if(now - pulse->started >= pulse->duration) {
+      digitalWrite(i, OUTPUT_LOW);
+      pulse->active = false;
+      pulse->finished = true;
+    }
+  }
+
+  this->checkInputs();
+
+  for(int n=0; n<=MAX_PINNUMBER; n++) {
+    int pin = this->nextSamplePin;
+    this->nextSamplePin = (pin + 1) % (MAX_PINNUMBER + 1);
+    SensorDriver *driver = sensorDriver(pin);
+    if(!driver) continue;
+    MySample *sample = &this->samples[pin];
+    if(sample->converting) {
+      if((long)(now - sample->readyAt) >= 0) {
+        this->finishSample(pin, driver);
+        break;
+      }
+    } else if(now - sample->lastAttempt >= sampleInterval(driver)) {
+      this->startSample(pin, driver);
+      break;
+    }
+  }
+}
+
+/**
+ * Milliseconds until the next pulse expires
+ * Returns 0 if there are events waiting to be fetched
+ */
+unsigned long IOHandler::millisToNextEvent() {
+  unsigned long now = millis();
+  unsigned long wait = (unsigned long)-1;
+  if(this->eventPending()) return 0;
+  for(int i=0; i<=MAX_PINNUMBER; i++) {
+    MyPulse *pulse = &this->pulses[i];
+    if(pulse->finished) return 0;
+    if(!pulse->active) continue;
+    unsigned long elapsed = now - pulse->started;
+    if(elapsed >= pulse->duration) return 0;
+    wait = min(wait, pulse->duration - elapsed);
+  }
+  for(int n=0; n<PIN_MAP_SIZE; n++) {
+    SensorDriver *driver = sensorDriver(pinMap[n].pin);
+    if(!driver) continue;
+    MySample *sample = &this->samples[pinMap[n].pin];
+    if(sample->ready) return 0;
+    if(sample->converting) {
+      if((long)(now - sample->readyAt) >= 0) return 0;
+      wait = min(wait, sample->readyAt - now);
+      continue;
+    }
+    unsigned long elapsed = now - sample->lastAttempt;
+    unsigned long interval = sampleInterval(driver);
+    if(elapsed >= interval) return 0;
+    wait = min(wait, interval - elapsed);
+  }
+  for(int n=0; n<PIN_MAP_SIZE; n++) {
+    if(pinMap[n].config != PINCONFIG_DI) continue;
+    unsigned long elapsed = micros() - this->inputs[pinMap[n].pin].lastEdge;
+    if(elapsed < DI_DEBOUNCE_TIME) {
+      // Check the settled level when the debounce time has passed
+      wait = min(wait, (DI_DEBOUNCE_TIME - elapsed) / 1000 + 1);
+    }
+  }
+  return wait;
+}
+
+/**
+ * Fetch the next pending IO event
+ * Returns false when there is nothing to report
+ */
+bool IOHandler::pollEvent(IOHandler::IOEvent *event) {
+  MyEdge edge;
+  AnalogInput::MyWindow window;
+  int pin;
+  if(this->analogInput.takeWindow(&window)) {
+    event->type = IOEVENT_WindowReady;
+    event->pin = this->analogInput.pin();
+    return true;
+  }
+  if(this->analogOutput.takeFinished(&pin)) {
+    event->type = IOEVENT_OutputFinished;
+    event->pin = pin;
+    return true;
+  }
+  if(this->edges.pop(&edge)) {
+    event->type = IOEVENT_InputChanged;
+    event->pin = edge.pin;
+    event->level = edge.level;
+    event->count = edge.count;
+    event->micros = edge.micros;
+    return true;
+  }
+  for(int i=0; i<=MAX_PINNUMBER; i++) {
+    if(this->pulses[i].finished) {
+      this->pulses[i].finished = false;
+      event->type = IOEVENT_PulseFinished;
+      event->pin = i;
+      return true;
+    }
+    if(this->samples[i].ready) {
+      this->samples[i].ready = false;
+      event->type = IOEVENT_SampleReady;
+      event->pin = i;
+      return true;
+    }
+  }
+  event->type = IOEVENT_None;
   return false;
-#endif
 }
 
 /**
- * Check if a pin is configured correct
+ * Check if input edges, analog windows or finished outputs are waiting,
+ * cheap enough to call while idle
  */
-bool IOHandler::checkPinConfig(int pin, IOHandler::PinConfig config) {
-  if(pin > MAX_PINNUMBER || pin < 0) {
-    return false;
+bool IOHandler::eventPending() {
+  return !this->edges.empty() || this->analogInput.windowReady() || this->analogOutput.finishedPending();
+}
+
+/**
+ * Perform a read values command
+ * Dispatched on the configuration of the pin
+ */
+IOHandler::IOResult IOHandler::runReadValues(int pin, unsigned long maxAge, char *text, IOHandler::MyValues *values) {
+  return (this->*readHandlers[pinConfig(pin)])(pin, maxAge, text, values);
+}
+
+/**
+ * ReadValues on a pin without readings
+ */
+IOHandler::IOResult IOHandler::readUnsupported(int /*pin*/, unsigned long /*maxAge*/, char *text, IOHandler::MyValues * /*values*/) {
+  strcpy(text, "Pin does not support readings");
+  return IO_Failed;
+}
+
+/**
+ * ReadValues on a digital input: level and rising edge count
+ */
+IOHandler::IOResult IOHandler::readDigital(int pin, unsigned long /*maxAge*/, char *text, IOHandler::MyValues *values) {
+  values->count = 0;
+  this->addValue(values, VALUE_Level, this->inputs[pin].level);
+  this->addValue(values, VALUE_Count, this->inputs[pin].count);
+  strcpy(text, "");
+  return IO_Ok;
+}
+
+/**
+ * ReadValues on the analog input: the latest window
+ */
+IOHandler::IOResult IOHandler::readAnalog(int /*pin*/, unsigned long /*maxAge*/, char *text, IOHandler::MyValues *values) {
+  AnalogInput::MyWindow window;
+  if(!this->analogInput.lastWindow(&window)) {
+    strcpy(text, "No analog window yet");
+    return IO_Failed;
+  }
+  this->readWindow(&window, values);
+  strcpy(text, "");
+  return IO_Ok;
+}
+
+/**
+ * ReadValues on a PWM output: the current level
+ */
+IOHandler::IOResult IOHandler::readOutput(int pin, unsigned long /*maxAge*/, char *text, IOHandler::MyValues *values) {
+  values->count = 0;
+  this->addValue(values, VALUE_Output, this->analogOutput.level(pin));
+  strcpy(text, "");
+  return IO_Ok;
+}
+
+/**
+ * ReadValues on a sensor
+ * Sensors are served from the sample cache. If the cached sample is older
+ * than maxAge, the request is answered after the next background sample,
+ * so concurrent requests share one acquisition.
+ */
+IOHandler::IOResult IOHandler::readSample(int pin, unsigned long maxAge, char *text, IOHandler::MyValues *values) {
+  MySample *sample = &this->samples[pin];
+  unsigned long age = millis() - sample->sampledAt;
+  if(sample->valid && age <= maxAge) {
+    *values = sample->values;
+    this->addValue(values, VALUE_Age, age);
+    strcpy(text, "");
+    return IO_Ok;
+  }
+  if(maxAge == ANY_AGE) {
+    strcpy(text, "No valid sample");
+    return IO_Failed;
   }
-  return (this->myIOs[pin].active && this->myIOs[pin].config == config);
+  sample->pending = true;
+  strcpy(text, "Waiting for sample");
+  return IO_Pending;
+}
+
+/**
+ * Start a background sample
+ * The result is fetched by loop() when the sensor has converted.
+ */
+void IOHandler::startSample(int pin, SensorDriver *driver) {
+  MySample *sample = &this->samples[pin];
+  sample->lastAttempt = millis();
+  sample->readyAt = sample->lastAttempt + driver->startSample();
+  sample->converting = true;
+}
+
+/**
+ * Fetch a background sample and wake up waiting requests
+ */
+void IOHandler::finishSample(int pin, SensorDriver *driver) {
+  METRICS_SECTION(METRIC_SensorRead);
+  MySample *sample = &this->samples[pin];
+  MyValues values;
+  values.count = 0;
+
+  sample->converting = false;
+  if(driver->readResult(&values)) {
+    sample->values = values;
+    sample->sampledAt = millis();
+    sample->valid = true;
+  } else {
+    LOG_WARN("Pin %d: %s read failed", pin, driver->name());
+  }
+  if(sample->pending) {
+    sample->pending = false;
+    sample->ready = true;
+  }
+}
+
+/**
+ * Convert an analog window to values
+ */
+void IOHandler::readWindow(AnalogInput::MyWindow *window, IOHandler::MyValues *values) {
+  values->count = 0;
+  this->addValue(values, VALUE_Analog, window->last);
+  this->addValue(values, VALUE_Min, window->min);
+  this->addValue(values, VALUE_Max, window->max);
+  this->addValue(values, VALUE_Mean, window->mean);
+  this->addValue(values, VALUE_Jitter, window->jitter);
+  this->addValue(values, VALUE_Cpu, window->cpu);
+  this->addValue(values, VALUE_Age, millis() - window->endedAt);
+}
+
+/**
+ * Append a value to a reading
+ */
+void IOHandler::addValue(IOHandler::MyValues *values, IOHandler::ValueType type, long value) {
+  if(values->count >= MAX_VALUES) {
+    return;
+  }
+  values->value[values->count].type = type;
+  values->value[values->count].value = value;
+  values->count++;
+}
+
+/**
+ * JSON field name of a value type
+ */
+const char *IOHandler::valueName(IOHandler::ValueType type) {
+  return valueNames[type];
+}
+
+/**
+ * Number of decimals in the fixed point value of a value type
+ */
+int IOHandler::valueDecimals(IOHandler::ValueType type) {
+  return valueDecimalCount[type];
 }
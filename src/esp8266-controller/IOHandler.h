@@ -2,9 +2,11 @@
 #define IOHandler_h
 #include <Arduino.h>
 #include "myconstants.h"
-#ifdef EXTLIB_DHT22
-#include "DHT.h"
-#endif
+#include "SpscQueue.h"
+#include "AnalogInput.h"
+#include "AnalogOutput.h"
+
+class SensorDriver;
 
 class IOHandler {
   public:
@@ -13,32 +15,132 @@ class IOHandler {
       PINCONFIG_DI,
       PINCONFIG_DO,
       PINCONFIG_AI,
-      PINCONFIG_AO
-#ifdef EXTLIB_DHT22
-     ,PINCONFIG_DHT22
-#endif
+      PINCONFIG_AO,
+      PINCONFIG_DHT22,   // Requires EXTLIB_DHT22
+      PINCONFIG_DS18B20, // Requires EXTLIB_ONEWIRE
+      PINCONFIG_SHT31,   // I2C SDA, SCL is I2C_SCL_PIN
+      PINCONFIG_Count
+    };
+    enum IOEventType {
+      IOEVENT_None,
+      IOEVENT_PulseFinished,
+      IOEVENT_SampleReady,
+      IOEVENT_InputChanged,
+      IOEVENT_WindowReady,
+      IOEVENT_OutputFinished
+    };
+    enum IOResult {
+      IO_Failed,
+      IO_Ok,
+      IO_Pending // Answer when IOEVENT_SampleReady is reported
     };
-    struct MyIOs {
-      bool active;
-      PinConfig config;
+    struct IOEvent {
+      IOEventType   type;
+      int           pin;
+      int           level;  // IOEVENT_InputChanged: new level
+      unsigned long count;  // IOEVENT_InputChanged: rising edges since start
+      unsigned long micros; // IOEVENT_InputChanged: micros() at the edge
+    };
+    enum ValueType {
+      VALUE_Temperature, // 0.1 degC
+      VALUE_Humidity,    // 0.1 %RH
+      VALUE_Age,         // ms since the sample was taken
+      VALUE_Level,       // Digital input level
+      VALUE_Count,       // Rising edges on a digital input
+      VALUE_Analog,      // 0.01 ADC steps, filtered
+      VALUE_Min,         // 0.01 ADC steps, lowest filtered value in the window
+      VALUE_Max,         // 0.01 ADC steps, highest filtered value in the window
+      VALUE_Mean,        // 0.01 ADC steps, mean filtered value in the window
+      VALUE_Jitter,      // us, largest deviation from the sample interval
+      VALUE_Cpu,         // us spent per sample
+      VALUE_Output       // 0.1 %, level of a PWM output
+    };
+    struct MyValue {
+      ValueType type;
+      long      value; // Fixed point, see valueDecimals()
+    };
+    struct MyValues {
+      int     count;
+      MyValue value[MAX_VALUES];
     };
     
+    static const unsigned long ANY_AGE = (unsigned long)-1; // Latest sample, however old
+
     IOHandler();
     void setup();
-    bool assignPinConfiguration(int pin, IOHandler::PinConfig config);
+    void loop();
+    bool pollEvent(IOHandler::IOEvent *event);
+    bool eventPending();
+    unsigned long millisToNextEvent();
+    static IOHandler::PinConfig pinConfig(int pin);
 
-    void flashLed(int ledPin, int numberOfTimes, int waitTime);
     bool runToggleOnOff(int pin, int waittime, char *text);
-    bool runReadValues(int pin, char *text, char *jsonValue);
+    IOResult runReadValues(int pin, unsigned long maxAge, char *text, IOHandler::MyValues *values);
+    bool runFade(int pin, int level, unsigned long duration, AnalogOutput::Curve curve, char *text);
+    bool runSequence(int pin, const AnalogOutput::MyStep *steps, int count, int repeat, AnalogOutput::Curve curve, char *text);
+
+    static const char *valueName(IOHandler::ValueType type);
+    static int valueDecimals(IOHandler::ValueType type);
+    static void addValue(IOHandler::MyValues *values, IOHandler::ValueType type, long value);
 
   private:
-    MyIOs myIOs[MAX_PINNUMBER+1];
-#ifdef EXTLIB_DHT22
-    DHT *dht22[MAX_PINNUMBER+1];
-#endif
+    struct MyPulse {
+      bool          active;
+      bool          finished;
+      unsigned long started;
+      unsigned long duration;
+    };
+
+    struct MySample {
+      bool          valid;
+      bool          pending;   // Requests are waiting for the next sample
+      bool          ready;     // Report IOEVENT_SampleReady
+      bool          converting; // Started, the result is fetched at readyAt
+      unsigned long readyAt;
+      unsigned long sampledAt;
+      unsigned long lastAttempt;
+      MyValues      values;
+    };
+
+    struct MyInput {
+      IOHandler              *owner;
+      int                     pin;
+      volatile int            level;    // Last accepted level
+      volatile unsigned long  lastEdge; // micros() of the last accepted edge
+      volatile unsigned long  count;    // Accepted rising edges
+    };
+
+    struct MyEdge {
+      byte          pin;
+      byte          level;
+      unsigned long count;
+      unsigned long micros;
+    };
+
+    MyPulse pulses[MAX_PINNUMBER+1];
+    MySample samples[MAX_PINNUMBER+1];
+    int nextSamplePin;
+    MyInput inputs[MAX_PINNUMBER+1];
+    SpscQueue<MyEdge, DI_QUEUE_SIZE> edges;
+    AnalogInput analogInput;
+    AnalogOutput analogOutput;
+    volatile unsigned long droppedEdges;
+    unsigned long reportedDroppedEdges;
+
+    typedef IOResult (IOHandler::*ReadHandler)(int pin, unsigned long maxAge, char *text, IOHandler::MyValues *values);
+    static const ReadHandler readHandlers[PINCONFIG_Count];
 
-    bool checkPinConfig(int pin, IOHandler::PinConfig config);
-    bool readDht22(int pin, char *text, char *jsonValue);
+    IOResult readUnsupported(int pin, unsigned long maxAge, char *text, IOHandler::MyValues *values);
+    IOResult readDigital(int pin, unsigned long maxAge, char *text, IOHandler::MyValues *values);
+    IOResult readAnalog(int pin, unsigned long maxAge, char *text, IOHandler::MyValues *values);
+    IOResult readOutput(int pin, unsigned long maxAge, char *text, IOHandler::MyValues *values);
+    IOResult readSample(int pin, unsigned long maxAge, char *text, IOHandler::MyValues *values);
+    static void onInputEdge(void *arg);
+    void recordEdge(IOHandler::MyInput *input, int level, unsigned long now);
+    void checkInputs();
+    void startSample(int pin, SensorDriver *driver);
+    void finishSample(int pin, SensorDriver *driver);
+    void readWindow(AnalogInput::MyWindow *window, IOHandler::MyValues *values);
 };
 
 #endif
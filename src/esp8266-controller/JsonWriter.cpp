@@ -0,0 +1,191 @@
+/*
+ * JsonWriter
+ * Allocation free JSON formatting into a fixed buffer
+ *
+ * @author Steinar Thorshaug
+ */
+#include "JsonWriter.h"
+
+/**
+ * Constructor
+ */
+JsonWriter::JsonWriter(char *buffer, unsigned int size) {
+  this->buffer = buffer;
+  this->size = size;
+  this->reset();
+}
+
+/**
+ * Start over with an empty buffer
+ */
+void JsonWriter::reset() {
+  this->pos = 0;
+  this->overflowed = this->size == 0;
+  this->needComma = false;
+  if(this->size > 0) {
+    this->buffer[0] = 0;
+  }
+}
+
+void JsonWriter::beginObject(const char *key) {
+  this->beginValue(key);
+  this->append('{');
+  this->needComma = false;
+}
+
+void JsonWriter::endObject() {
+  this->append('}');
+  this->needComma = true;
+}
+
+void JsonWriter::beginArray(const char *key) {
+  this->beginValue(key);
+  this->append('[');
+  this->needComma = false;
+}
+
+void JsonWriter::endArray() {
+  this->append(']');
+  this->needComma = true;
+}
+
+void JsonWriter::addString(const char *key, const char *value) {
+  this->beginValue(key);
+  this->append('"');
+  this->appendEscaped(value);
+  this->append('"');
+}
+
+void JsonWriter::addInt(const char *key, long value) {
+  this->beginValue(key);
+  if(value < 0) {
+    this->append('-');
+    this->appendUnsigned(-(uint64_t)(int64_t)value);
+  } else {
+    this->appendUnsigned(value);
+  }
+}
+
+void JsonWriter::addUnsigned(const char *key, unsigned long value) {
+  this->beginValue(key);
+  this->appendUnsigned(value);
+}
+
+void JsonWriter::addUnsigned64(const char *key, uint64_t value) {
+  this->beginValue(key);
+  this->appendUnsigned(value);
+}
+
+/**
+ * Add a fixed point number, e.g. 215 with 1 decimal is written as 21.5
+ */
+void JsonWriter::addFixed(const char *key, long value, int decimals) {
+  unsigned long scale = 1;
+  for(int i=0; i<decimals; i++) {
+    scale *= 10;
+  }
+  this->beginValue(key);
+  unsigned long magnitude = value < 0 ? -(unsigned long)value : value;
+  if(value < 0) {
+    this->append('-');
+  }
+  this->appendUnsigned(magnitude / scale);
+  if(decimals > 0) {
+    unsigned long fraction = magnitude % scale;
+    this->append('.');
+    for(unsigned long digit = scale / 10; digit > 0; digit /= 10) {
+      this->append('0' + (fraction / digit) % 10);
+    }
+  }
+}
+
+void JsonWriter::addBool(const char *key, bool value) {
+  this->beginValue(key);
+  this->append(value ? "true" : "false");
+}
+
+/**
+ * Add an already formatted JSON value
+ */
+void JsonWriter::addRaw(const char *key, const char *json) {
+  this->beginValue(key);
+  this->append(json);
+}
+
+/**
+ * True if anything did not fit in the buffer
+ */
+bool JsonWriter::overflow() {
+  return this->overflowed;
+}
+
+unsigned int JsonWriter::length() {
+  return this->pos;
+}
+
+const char *JsonWriter::c_str() {
+  return this->buffer;
+}
+
+/**
+ * Write the separator and key of the next value
+ */
+void JsonWriter::beginValue(const char *key) {
+  if(this->needComma) {
+    this->append(',');
+  }
+  if(key) {
+    this->append('"');
+    this->append(key);
+    this->append("\":");
+  }
+  this->needComma = true;
+}
+
+void JsonWriter::append(char c) {
+  if(this->pos + 1 >= this->size) {
+    this->overflowed = true;
+    return;
+  }
+  this->buffer[this->pos++] = c;
+  this->buffer[this->pos] = 0;
+}
+
+void JsonWriter::append(const char *text) {
+  while(*text) {
+    this->append(*text++);
+  }
+}
+
+void JsonWriter::appendEscaped(const char *text) {
+  for(; *text; text++) {
+    char c = *text;
+    if(c == '"' || c == '\\') {
+      this->append('\\');
+      this->append(c);
+    } else if((unsigned char)c < 0x20) {
+      this->append(' ');
+    } else {
+      this->append(c);
+    }
+  }
+}
+
+void JsonWriter::appendUnsigned(uint64_t value) {
+  char digits[21];
+  int n = 0;
+  if(value <= 0xFFFFFFFFUL) {
+    // Avoid 64 bit division when not needed
+    unsigned long small = value;
+    do {
+      digits[n++] = '0' + (small % 10);
+      small /= 10;
+    } while(small > 0);
+  } else do {
+    digits[n++] = '0' + (value % 10);
+    value /= 10;
+  } while(value > 0);
+  while(n > 0) {
+    this->append(digits[--n]);
+  }
+}
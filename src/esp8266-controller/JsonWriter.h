@@ -0,0 +1,44 @@
+#ifndef JsonWriter_h
+#define JsonWriter_h
+#include <Arduino.h>
+
+/*
+ * Streaming JSON writer
+ * Writes into a caller provided buffer and never allocates. Output that
+ * does not fit sets the overflow flag instead of being silently cut.
+ */
+class JsonWriter {
+  public:
+    JsonWriter(char *buffer, unsigned int size);
+    void reset();
+    void beginObject(const char *key = NULL);
+    void endObject();
+    void beginArray(const char *key = NULL);
+    void endArray();
+    void addString(const char *key, const char *value);
+    void addInt(const char *key, long value);
+    void addUnsigned(const char *key, unsigned long value);
+    void addUnsigned64(const char *key, uint64_t value);
+    void addFixed(const char *key, long value, int decimals);
+    void addBool(const char *key, bool value);
+    void addRaw(const char *key, const char *json);
+
+    bool overflow();
+    unsigned int length();
+    const char *c_str();
+
+  private:
+    char *buffer;
+    unsigned int size;
+    unsigned int pos;
+    bool overflowed;
+    bool needComma;
+
+    void append(char c);
+    void append(const char *text);
+    void appendEscaped(const char *text);
+    void appendUnsigned(uint64_t value);
+    void beginValue(const char *key);
+};
+
+#endif
@@ -0,0 +1,180 @@
+/*
+ * Log
+ * Log lines are formatted into a RAM ring buffer and drained to the UART
+ * from the main loop, only as much as the UART FIFO can take without
+ * blocking. With LOG_TO_MQTT the same lines are also published in batches.
+ *
+ * @author Steinar Thorshaug
+ */
+#include "Log.h"
+#include <PubSubClient.h>
+
+const unsigned int LOG_BUFFER_SIZE = 1024;  // Must be a power of two
+const unsigned int LOG_LINE_LENGTH = 128;
+const unsigned long LOG_MQTT_INTERVAL = 5000; // ms between log batches
+// Largest log batch in bytes, what fits in MQTT_MAX_PACKET_SIZE with the
+// fixed header and the topic
+const unsigned int LOG_MQTT_BATCH = MQTT_MAX_PACKET_SIZE - MAX_TOPIC_LENGTH - 7;
+
+static_assert(MQTT_MAX_PACKET_SIZE >= MAX_TOPIC_LENGTH + 7 + 32, "MQTT_MAX_PACKET_SIZE is too small for log batches");
+
+static char ring[LOG_BUFFER_SIZE];
+static unsigned int head = 0;      // Next write position
+static unsigned int uartTail = 0;  // Next position to write to the UART
+static unsigned int dropped = 0;   // Lines dropped since last report
+static const char levelChar[] = "-EWID";
+
+#ifdef LOG_TO_MQTT
+static unsigned int mqttTail = 0;
+static PubSubClient *logMqtt = NULL;
+static char logTopic[MAX_TOPIC_LENGTH];
+static unsigned long lastMqttBatch = 0;
+#endif
+
+/**
+ * Copy a line into the ring buffer
+ */
+static void ringAppend(const char *line, unsigned int length) {
+  if(length > LOG_BUFFER_SIZE - (head - uartTail)) {
+    dropped++;
+    return;
+  }
+#ifdef LOG_TO_MQTT
+  // The MQTT reader may lag behind. It loses the oldest lines.
+  if(head + length - mqttTail > LOG_BUFFER_SIZE) {
+    mqttTail = head + length - LOG_BUFFER_SIZE;
+    while(mqttTail != head && ring[(mqttTail - 1) & (LOG_BUFFER_SIZE - 1)] != '\n') {
+      mqttTail++;
+    }
+  }
+#endif
+  for(unsigned int i=0; i<length; i++) {
+    ring[(head + i) & (LOG_BUFFER_SIZE - 1)] = line[i];
+  }
+  head += length;
+}
+
+/**
+ * Format a log line and queue it
+ * The format string must be in flash, use the LOG_* macros.
+ */
+void logWrite(byte level, const char *format, ...) {
+  char line[LOG_LINE_LENGTH];
+  va_list args;
+
+  if(dropped > 0) {
+    int n = snprintf(line, sizeof(line), "%lu W: %u log lines dropped\n", millis(), dropped);
+    if((unsigned int)n <= LOG_BUFFER_SIZE - (head - uartTail)) {
+      dropped = 0;
+      ringAppend(line, n);
+    }
+  }
+
+  int prefix = snprintf(line, sizeof(line), "%lu %c: ", millis(), levelChar[level]);
+  va_start(args, format);
+  int n = vsnprintf_P(line + prefix, sizeof(line) - prefix - 1, format, args);
+  va_end(args);
+  if(n < 0) {
+    n = 0;
+  }
+  unsigned int length = prefix + min(n, (int)(sizeof(line) - prefix - 2));
+  line[length++] = '\n';
+  ringAppend(line, length);
+}
+
+#ifdef LOG_TO_MQTT
+/**
+ * Enable publishing of log lines to <base>/log
+ */
+void logSetMqtt(PubSubClient *mqtt, const char *baseTopic) {
+  logMqtt = mqtt;
+  snprintf(logTopic, sizeof(logTopic), "%s/log", baseTopic);
+}
+#else
+/**
+ * Does nothing unless LOG_TO_MQTT is defined
+ */
+void logSetMqtt(PubSubClient * /*mqtt*/, const char * /*baseTopic*/) {
+}
+#endif
+
+#ifdef LOG_TO_MQTT
+/**
+ * Publish the oldest complete lines as one message
+ * A batch that can not be published is dropped, so a failing publish never
+ * holds up the lines behind it.
+ */
+static void publishBatch() {
+  char batch[LOG_MQTT_BATCH + 1];
+  unsigned int length = 0;
+  unsigned int lastLineEnd = 0;
+
+  while(length < LOG_MQTT_BATCH && mqttTail + length != head) {
+    char c = ring[(mqttTail + length) & (LOG_BUFFER_SIZE - 1)];
+    batch[length++] = c;
+    if(c == '\n') {
+      lastLineEnd = length;
+    }
+  }
+  if(lastLineEnd == 0) {
+    // A single line longer than a batch
+    lastLineEnd = length;
+  }
+  batch[lastLineEnd] = 0;
+  mqttTail += lastLineEnd;
+  if(!logMqtt->publish(logTopic, batch)) {
+    LOG_WARN("Log: %u bytes not published to %s", lastLineEnd, logTopic);
+  }
+}
+#endif
+
+/**
+ * Drain the ring buffer
+ * Never waits for the UART, and publishes at most one MQTT batch
+ */
+void logLoop() {
+  int room = Serial.availableForWrite();
+  while(room > 0 && uartTail != head) {
+    unsigned int start = uartTail & (LOG_BUFFER_SIZE - 1);
+    unsigned int chunk = min(head - uartTail, LOG_BUFFER_SIZE - start);
+    chunk = min(chunk, (unsigned int)room);
+    Serial.write((const uint8_t*)&ring[start], chunk);
+    uartTail += chunk;
+    room -= chunk;
+  }
+
+#ifdef LOG_TO_MQTT
+  if(logMqtt && logMqtt->connected() && mqttTail != head &&
+     millis() - lastMqttBatch >= LOG_MQTT_INTERVAL) {
+    lastMqttBatch = millis();
+    publishBatch();
+  }
+#endif
+}
+
+/**
+ * Write everything to the UART, waiting if needed
+ * Used before blocking operations and restarts
+ */
+void logFlush() {
+  while(uartTail != head) {
+    logLoop();
+    yield();
+  }
+}
+
+/**
+ * Milliseconds until logLoop() has something to do
+ */
+unsigned long millisToNextLogEvent() {
+  if(uartTail != head) {
+    return 1;
+  }
+#ifdef LOG_TO_MQTT
+  if(logMqtt && mqttTail != head) {
+    unsigned long elapsed = millis() - lastMqttBatch;
+    return elapsed >= LOG_MQTT_INTERVAL ? 0 : LOG_MQTT_INTERVAL - elapsed;
+  }
+#endif
+  return (unsigned long)-1;
+}
@@ -0,0 +1,48 @@
+#ifndef Log_h
+#define Log_h
+#include <Arduino.h>
+#include "myconstants.h"
+
+class PubSubClient;
+
+#define LOG_LEVEL_NONE  0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN  2
+#define LOG_LEVEL_INFO  3
+#define LOG_LEVEL_DEBUG 4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+/*
+ * Logging macros
+ * Takes printf style arguments. The format string is kept in flash.
+ */
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(fmt, ...) logWrite(LOG_LEVEL_ERROR, PSTR(fmt), ##__VA_ARGS__)
+#else
+#define LOG_ERROR(fmt, ...) do {} while(0)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(fmt, ...) logWrite(LOG_LEVEL_WARN, PSTR(fmt), ##__VA_ARGS__)
+#else
+#define LOG_WARN(fmt, ...) do {} while(0)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(fmt, ...) logWrite(LOG_LEVEL_INFO, PSTR(fmt), ##__VA_ARGS__)
+#else
+#define LOG_INFO(fmt, ...) do {} while(0)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(fmt, ...) logWrite(LOG_LEVEL_DEBUG, PSTR(fmt), ##__VA_ARGS__)
+#else
+#define LOG_DEBUG(fmt, ...) do {} while(0)
+#endif
+
+void logWrite(byte level, const char *format, ...);
+void logSetMqtt(PubSubClient *mqtt, const char *baseTopic);
+void logLoop();
+void logFlush();
+unsigned long millisToNextLogEvent();
+#endif
@@ -7,8 +7,173 @@
 #include <ESP8266WiFi.h>
 #include "MessageHandler.h"
 #include "TimeController.h"
+#include "BinaryProtocol.h"
+#include "Log.h"
+#include "Metrics.h"
+#include "StatusLed.h"
+#include "FastBoot.h"
 
 static char genericString[151];
+static JsonWriter json(genericString, sizeof(genericString));
+// Buffered readings, batch results and alive messages. The largest payload
+// that fits in MQTT_MAX_PACKET_SIZE with the fixed header and the topic.
+static char batchString[MQTT_MAX_PACKET_SIZE - MAX_TOPIC_LENGTH - 7];
+// Room for {"dropped":4294967295,"readings":[]} around the readings
+static const unsigned int TELEMETRY_BATCH_OVERHEAD = 40;
+// Any reading that can be formatted must fit in a batch of its own
+static_assert(sizeof(batchString) >= sizeof(genericString) + TELEMETRY_BATCH_OVERHEAD,
+  "MQTT_MAX_PACKET_SIZE must be at least 256 to forward buffered readings");
+#ifdef ENABLE_METRICS
+// Loop metrics, the largest payload that fits in a packet
+static char metricsString[MQTT_MAX_PACKET_SIZE - MAX_TOPIC_LENGTH - 7];
+static_assert(MQTT_MAX_PACKET_SIZE >= 512, "MQTT_MAX_PACKET_SIZE must be at least 512 with ENABLE_METRICS");
+#endif
+static const unsigned long ALIVE_INTERVAL = 30000; // ms between alive messages
+static const unsigned long ALIVE_RETRY_INTERVAL = 1000; // ms before an alive message that failed is sent again
+static const unsigned int ALIVE_MESSAGE_SIZE = 188; // Longest alive message with the boot times and the terminator
+static_assert(sizeof(batchString) >= ALIVE_MESSAGE_SIZE, "MQTT_MAX_PACKET_SIZE is too small for the alive message");
+static const unsigned long TELEMETRY_FLUSH_INTERVAL = 500; // ms between batches of buffered readings
+static const int TELEMETRY_BATCH_SIZE = 8; // Most readings in one batch
+static const char BATCH_SEPARATOR = '|'; // Separates the requests of a batch
+static const char BATCH_ATOMIC = '!';    // Leading character of an all-or-nothing batch
+static const unsigned int BATCH_RESULTS_OPEN = 58;  // {"time":...,"tms":...,"results":[
+static const unsigned int BATCH_RESULTS_CLOSE = 30; // ],"status":false,"omitted":8} and the terminator
+static const unsigned int BATCH_RESULT_SIZE = 104;  // One result without values, with its separator
+static_assert(sizeof(batchString) >= BATCH_RESULTS_OPEN + BATCH_RESULT_SIZE + BATCH_RESULTS_CLOSE,
+  "MQTT_MAX_PACKET_SIZE is too small for batch results");
+
+/*
+ * Supported commands and the most fields they take after the wait time
+ * Add new commands here. The lookup is a switch on the FNV-1a hash of the
+ * name, so two names with the same hash give a duplicate case compile error.
+ */
+#define REQUEST_COMMANDS(X) \
+  X(REQ_ToggleOnOff, "ToggleOnOff", 0) \
+  X(REQ_ReadValues,  "ReadValues",  0) \
+  X(REQ_Fade,        "Fade",        2) \
+  X(REQ_Sequence,    "Sequence",    MAX_REQUEST_ARGS)
+
+/*
+ * Messages for MessageHandler::ParseError
+ */
+static const char *parseErrorText[] = {
+  "",
+  "No request found",
+  "Unknown request",
+  "No pin number found",
+  "Invalid pin number",
+  "No wait time found",
+  "Invalid wait time",
+  "Unexpected data after wait time",
+  "Invalid argument"
+};
+
+/**
+ * FNV-1a hash of a command name, evaluated at compile time
+ */
+static constexpr uint32_t commandNameHash(const char *name, uint32_t hash = 2166136261UL) {
+  return *name ? commandNameHash(name + 1, (uint32_t)((hash ^ (uint8_t)*name) * 16777619UL)) : hash;
+}
+
+/**
+ * FNV-1a hash of a command name in a payload
+ */
+static uint32_t hashCommand(const char *name, unsigned int length) {
+  uint32_t hash = 2166136261UL;
+  for(unsigned int i=0; i<length; i++) {
+    hash = (uint32_t)((hash ^ (uint8_t)name[i]) * 16777619UL);
+  }
+  return hash;
+}
+
+/**
+ * Most fields a command takes after the wait time
+ */
+static int maxRequestArgs(MessageHandler::MyRequestType type) {
+  switch(type) {
+#define COMMAND_ARGS(reqType, reqName, reqArgs) \
+    case MessageHandler::reqType: \
+      return reqArgs;
+    REQUEST_COMMANDS(COMMAND_ARGS)
+#undef COMMAND_ARGS
+    default:
+      return 0;
+  }
+}
+
+/**
+ * Add values as JSON fields
+ */
+static void writeJsonValues(JsonWriter *json, const IOHandler::MyValues *values) {
+  for(int i=0; i<values->count; i++) {
+    const IOHandler::MyValue *value = &values->value[i];
+    json->addFixed(IOHandler::valueName(value->type), value->value, IOHandler::valueDecimals(value->type));
+  }
+}
+
+/**
+ * Start a message with batch results
+ */
+static void beginBatchResults(JsonWriter *batch) {
+  batch->reset();
+  batch->beginObject();
+  writeUtcTimeField(batch);
+  batch->beginArray("results");
+}
+
+/**
+ * Check if a text payload holds a batch of requests
+ */
+static bool isBatch(const char *payload, unsigned int length) {
+  return length > 0 && (payload[0] == BATCH_ATOMIC || memchr(payload, BATCH_SEPARATOR, length) != NULL);
+}
+
+/**
+ * Get the next ';' separated field
+ * Returns false if there are no more fields
+ */
+static bool nextField(const char **pos, const char *end, const char **field, unsigned int *length) {
+  const char *start = *pos;
+  if(start > end) {
+    return false;
+  }
+  const char *p = start;
+  while(p < end && *p != ';') {
+    p++;
+  }
+  *field = start;
+  *length = p - start;
+  *pos = p + 1;
+  return true;
+}
+
+/**
+ * Parse a decimal integer
+ * Unlike atoi() the whole field must be a number within the range of an int
+ */
+static bool parseInt(const char *field, unsigned int length, int *value) {
+  unsigned int i = 0;
+  bool negative = false;
+  long result = 0;
+  if(length > 0 && field[0] == '-') {
+    negative = true;
+    i++;
+  }
+  if(i == length) {
+    return false;
+  }
+  for(; i<length; i++) {
+    if(field[i] < '0' || field[i] > '9') {
+      return false;
+    }
+    result = result * 10 + (field[i] - '0');
+    if(result > 32767) {
+      return false;
+    }
+  }
+  *value = negative ? -result : result;
+  return true;
+}
 
 /**
  * Constructor
@@ -17,43 +182,144 @@ MessageHandler::MessageHandler(PubSubClient *mqtt, const char *mqttBaseTopic, IO
   this->mqtt = mqtt;
   this->mqttBaseTopic = mqttBaseTopic;
   this->ioHandler = ioHandler;
-  for(int i=0; i<10; i++) {
-    this->schedules[i].active = false;
+  for(int i=0; i<=MAX_PINNUMBER; i++) {
+    this->pulseEncoding[i] = ENCODING_Text;
+    this->outputRequest[i] = REQ_None;
+    this->pendingReads[i] = 0;
+    this->pendingScheduledReads[i] = false;
+    this->reports[i].enabled = false;
+    this->reports[i].reported = false;
+    this->reports[i].reportedAt = 0;
+  }
+  this->lastAliveMessage = 0;
+  this->aliveWait = 0;
+  this->aliveSent = false;
+  this->lastTelemetryFlush = 0;
+  this->queuedRequests = 0;
+}
+
+/**
+ * Build all topics once, so publishing does not need to format or allocate them
+ */
+void MessageHandler::setup() {
+  this->buildTopic(this->topicAlive, "/alive", -1);
+  this->buildTopic(this->topicAbout, "/about", -1);
+#ifdef ENABLE_METRICS
+  this->buildTopic(this->topicMetrics, "/metrics", -1);
+#endif
+  this->buildTopic(this->topicError, "/error", -1);
+  this->buildTopic(this->topicBinaryError, "/bin/error", -1);
+  for(int i=0; i<=MAX_PINNUMBER; i++) {
+    this->buildTopic(this->topicResponse[i], "/response/", i);
+    this->buildTopic(this->topicValues[i], "/values/", i);
+    this->buildTopic(this->topicBinary[i], "/bin/", i);
+    this->buildTopic(this->topicEvent[i], "/event/", i);
+  }
+  this->buildTopic(this->topicBuffered, "/buffered", -1);
+  this->buildTopic(this->topicBatch, "/batch", -1);
+  this->telemetry.setup();
+}
+
+/**
+ * Format <base><suffix>[pin] into a topic buffer
+ */
+void MessageHandler::buildTopic(char *topic, const char *suffix, int pin) {
+  int length;
+  if(pin >= 0) {
+    length = snprintf(topic, MAX_TOPIC_LENGTH, "%s%s%d", this->mqttBaseTopic, suffix, pin);
+  } else {
+    length = snprintf(topic, MAX_TOPIC_LENGTH, "%s%s", this->mqttBaseTopic, suffix);
+  }
+  if(length >= MAX_TOPIC_LENGTH) {
+    LOG_WARN("Topic truncated: %s", topic);
+  }
+}
+
+/**
+ * Publish a JSON message
+ */
+bool MessageHandler::publish(const char *topic, JsonWriter *json) {
+  if(!this->mqtt->connected()) {
+    METRICS_COUNT(COUNTER_PublishFailed);
+    return false;
+  }
+  if(json->overflow()) {
+    LOG_ERROR("MessageHandler: Message to %s does not fit in the buffer", topic);
+    return false;
+  }
+  LOG_DEBUG("Publish message to %s: %s", topic, json->c_str());
+  if(this->mqtt->publish(topic, json->c_str()) == 0) {
+    LOG_ERROR("MessageHandler: Failed to publish to mqtt. Too long message?");
+    METRICS_COUNT(COUNTER_PublishFailed);
+    return false;
+  }
+  METRICS_COUNT(COUNTER_PublishOk);
+  return true;
+}
+
+/**
+ * Publish a binary message
+ */
+bool MessageHandler::publish(const char *topic, const byte *frame, unsigned int length) {
+  if(!this->mqtt->connected()) {
+    METRICS_COUNT(COUNTER_PublishFailed);
+    return false;
+  }
+  LOG_DEBUG("Publish binary message to %s: %u bytes", topic, length);
+  if(this->mqtt->publish(topic, frame, length) == 0) {
+    LOG_ERROR("MessageHandler: Failed to publish to mqtt. Too long message?");
+    METRICS_COUNT(COUNTER_PublishFailed);
+    return false;
   }
-  this->activeSchedules = 0;
+  METRICS_COUNT(COUNTER_PublishOk);
+  return true;
 }
 
 /**
  * Add a scheduled repeated request
+ * Returns an id for removeScheduledRequest(), or -1 if all slots are taken
  */
-bool MessageHandler::addScheduledRequest(MyRequest *req, unsigned long interval) {
-  if(this->activeSchedules >= 10) {
+int MessageHandler::addScheduledRequest(MyRequest *req, unsigned long interval) {
+  int id = this->scheduler.add(interval);
+  if(id < 0) {
+    return -1;
+  }
+  this->scheduledRequests[id] = *req;
+  this->scheduledRequests[id].scheduled = true;
+  return id;
+}
+
+/**
+ * Remove a scheduled request
+ */
+bool MessageHandler::removeScheduledRequest(int id) {
+  return this->scheduler.remove(id);
+}
+
+/**
+ * Publish scheduled readings of a pin by exception
+ * Without a policy every scheduled reading is published
+ */
+bool MessageHandler::setReportPolicy(int pin, MyReportPolicy *policy) {
+  if(pin < 0 || pin > MAX_PINNUMBER) {
     return false;
   }
-  ScheduledItem *item = &this->schedules[this->activeSchedules];
-  this->activeSchedules++;
-  item->req = *req;
-  item->active = true;
-  item->interval = interval;
-  item->lastExecuted = 0;
+  this->reports[pin].policy = *policy;
+  this->reports[pin].enabled = true;
+  this->reports[pin].reported = false;
+  return true;
 }
 
 /**
  * Check if any scheduled requests are pending
  */
 bool MessageHandler::executeScheduledRequests() {
-  ScheduledItem *item = NULL;
   bool returnval = false;
-  unsigned long timenow = millis();
+  int id;
   
-  for(int i=0; i<this->activeSchedules; i++) {
-    item = &this->schedules[i];
-    if(!item->active) continue;
-    if(abs(timenow - item->lastExecuted) > item->interval) {
-      this->handleRequest(&item->req);
-      returnval = true;
-      item->lastExecuted = timenow;
-    }
+  while((id = this->scheduler.popDue(millis())) >= 0) {
+    this->handleRequest(&this->scheduledRequests[id]);
+    returnval = true;
   }
 
   return returnval;
@@ -61,67 +327,186 @@ bool MessageHandler::executeScheduledRequests() {
 
 /**
  * Format and send an alive message to the MQTT broker
+ * Until one is published, it also holds the boot times
+ * Returns true if it was published
  */
-void MessageHandler::sendAliveMessage() {
+bool MessageHandler::sendAliveMessage() {
+  char ip[16];
   IPAddress myIp = WiFi.localIP();
-  snprintf (genericString, 150, "{%s\"rssi\":%ld,\"ip\":\"%d.%d.%d.%d\"}", 
-    getCurrentUtcTimeAsJsonField(), WiFi.RSSI(), myIp[0], myIp[1], myIp[2], myIp[3]);
-  String topic = String(this->mqttBaseTopic);
-  topic.concat("/alive");
-  Serial.print("Publish message to ");
-  Serial.print(topic.c_str());
-  Serial.print(": ");
-  Serial.println(genericString);    
-  if(this->mqtt->publish(topic.c_str(), genericString) == 0) {
-    Serial.println("Failed to publish alive message to MQTT. Too long message?");
+  snprintf (ip, sizeof(ip), "%d.%d.%d.%d", myIp[0], myIp[1], myIp[2], myIp[3]);
+  JsonWriter alive(batchString, sizeof(batchString));
+  alive.beginObject();
+  writeUtcTimeField(&alive);
+  alive.addInt("rssi", WiFi.RSSI());
+  alive.addString("ip", ip);
+  alive.addUnsigned("heap", ESP.getFreeHeap());
+  alive.addUnsigned("maxblock", ESP.getMaxFreeBlockSize());
+  alive.addUnsigned("frag", ESP.getHeapFragmentation());
+  if(!this->aliveSent) {
+    fastBootWriteJson(&alive);
+  }
+  alive.endObject();
+  if(!this->publish(this->topicAlive, &alive)) {
+    return false;
   }
-  digitalWrite(STATUSLED, OUTPUT_HIGH);
-  delay(100);
-  digitalWrite(STATUSLED, OUTPUT_LOW);
+  statusLedShow(LED_Alive);
+  return true;
+}
+
+#ifdef ENABLE_METRICS
+/**
+ * Send loop timing and counters to the MQTT broker
+ */
+void MessageHandler::sendMetricsMessage() {
+  JsonWriter metrics(metricsString, sizeof(metricsString));
+  metrics.beginObject();
+  writeUtcTimeField(&metrics);
+  metricsWriteJson(&metrics);
+  metrics.endObject();
+  this->publish(this->topicMetrics, &metrics);
 }
+#endif
 
 /**
  * Send about-message to MQTT broker
  */
 void MessageHandler::sendAboutMessage() {
-  snprintf (genericString, 150, "{\"brand\":\"ESP8266\",\"id\":\"%ld\",\"version\":\"%s\"}", 
-    /*chipId*/ESP.getChipId(), SW_VERSION);
-  String topic = String(this->mqttBaseTopic);
-  topic.concat("/about");
-  Serial.print("Publish message to ");
-  Serial.print(topic.c_str());
-  Serial.print(": ");
-  Serial.println(genericString);    
-  if(this->mqtt->publish(topic.c_str(), genericString) == 0) {
-    Serial.println("Failed to publish to MQTT. Too long message?");
-  }
+  json.reset();
+  json.beginObject();
+  json.addString("brand", "ESP8266");
+  json.addUnsigned("id", ESP.getChipId());
+  json.addString("version", SW_VERSION);
+  json.endObject();
+  this->publish(this->topicAbout, &json);
 }
 
 /*
  * Handles messages
  * <reqtype>;<pin-number>;<delay>
+ * The payload is parsed in place in the MQTT client buffer. The decoded
+ * request is queued and run from loop(), batches are run at once.
  */
 void MessageHandler::handleRequest(char* topic, byte* payloadAsBytes, unsigned int length) {
-  char payload[100];
   MessageHandler::MyRequest request;
+  unsigned int errorPos = 0;
   
-  Serial.print("Message arrived [");
-  Serial.print(topic);
-  Serial.print("] ");
-  if(length >= 100) {
-    // todo: Report
-    Serial.println(" Message is too long");
+  (void)topic; // Only logged at LOG_LEVEL_DEBUG
+  ParseError error;
+  if(isBinaryRequest(payloadAsBytes, length)) {
+    LOG_DEBUG("Message arrived [%s] binary, %u bytes", topic, length);
+    error = decodeBinaryRequest(payloadAsBytes, length, &request);
+  } else {
+    LOG_DEBUG("Message arrived [%s] %.*s", topic, (int)length, (const char*)payloadAsBytes);
+    if(isBatch((const char*)payloadAsBytes, length)) {
+      this->handleBatch((const char*)payloadAsBytes, length);
+      return;
+    }
+    error = this->decodeRequest((const char*)payloadAsBytes, length, &request, &errorPos);
+  }
+  if(error != PARSE_Ok) {
+    LOG_WARN("Invalid request: %s", parseErrorText[error]);
+    this->sendParseError(&request, error, errorPos);
     return;
   }
-  strncpy(payload, (char*)payloadAsBytes, length);
-  payload[length] = 0;
-  Serial.print(payload);
-  Serial.println();
-  if(!this->decodeRequest(payload, &request)) {
+  this->queueRequest(&request);
+}
+
+/**
+ * Check if a request changes an output
+ * Control requests are run before reads.
+ */
+bool MessageHandler::isControlRequest(MessageHandler::MyRequest *req) {
+  return req->req != REQ_ReadValues;
+}
+
+/**
+ * Queue a decoded request
+ * A read of a pin with a read already queued is merged into that one,
+ * keeping the shortest max age. When the queue is full a control request
+ * takes the place of the newest read, and the request that does not fit
+ * is answered with busy. Returns false if the request was not queued.
+ */
+bool MessageHandler::queueRequest(MessageHandler::MyRequest *req) {
+  if(req->req == REQ_ReadValues) {
+    for(int i=0; i<this->queuedRequests; i++) {
+      MyRequest *queued = &this->requestQueue[i];
+      if(queued->req != REQ_ReadValues || queued->pin != req->pin || queued->encoding != req->encoding) continue;
+      int maxAge = queued->waittime > 0 ? queued->waittime : SAMPLE_MAX_AGE;
+      if(req->waittime > 0 && req->waittime < maxAge) {
+        queued->waittime = req->waittime;
+      }
+      LOG_DEBUG("Read of pin %d merged with a queued read", req->pin);
+      METRICS_COUNT(COUNTER_RequestMerged);
+      return true;
+    }
+  }
+  if(this->queuedRequests == REQUEST_QUEUE_SIZE) {
+    int newestRead = -1;
+    if(isControlRequest(req)) {
+      for(int i=this->queuedRequests-1; i>=0 && newestRead<0; i--) {
+        if(!isControlRequest(&this->requestQueue[i])) {
+          newestRead = i;
+        }
+      }
+    }
+    if(newestRead < 0) {
+      this->sendBusyResponse(req);
+      return false;
+    }
+    this->sendBusyResponse(&this->requestQueue[newestRead]);
+    this->removeQueuedRequest(newestRead);
+  }
+  this->requestQueue[this->queuedRequests++] = *req;
+  METRICS_SET(GAUGE_RequestQueueDepth, this->queuedRequests);
+  return true;
+}
+
+/**
+ * Remove a request from the queue, keeping the order of the rest
+ */
+void MessageHandler::removeQueuedRequest(int index) {
+  for(int i=index; i<this->queuedRequests-1; i++) {
+    this->requestQueue[i] = this->requestQueue[i+1];
+  }
+  this->queuedRequests--;
+}
+
+/**
+ * Run queued requests until REQUEST_TIME_BUDGET is used
+ * The oldest control request goes first, then the oldest read. At least
+ * one request is run per call.
+ */
+void MessageHandler::runQueuedRequests() {
+  unsigned long started = micros();
+  while(this->queuedRequests > 0) {
+    int next = 0;
+    for(int i=0; i<this->queuedRequests; i++) {
+      if(isControlRequest(&this->requestQueue[i])) {
+        next = i;
+        break;
+      }
+    }
+    MyRequest req = this->requestQueue[next];
+    this->removeQueuedRequest(next);
+    this->handleRequest(&req);
+    if(micros() - started >= REQUEST_TIME_BUDGET) {
+      break;
+    }
+  }
+  METRICS_SET(GAUGE_RequestQueueDepth, this->queuedRequests);
+}
+
+/**
+ * Answer a request that did not fit in the queue
+ */
+void MessageHandler::sendBusyResponse(MessageHandler::MyRequest *req) {
+  LOG_WARN("Request queue full, req %d on pin %d rejected", req->req, req->pin);
+  METRICS_COUNT(COUNTER_RequestBusy);
+  if(req->encoding == ENCODING_Binary) {
+    this->sendBinaryResponse(req, BINARY_STATUS_BUSY, "Busy", NULL);
     return;
   }
-  this->handleRequest(&request);
-  
+  this->sendMqttResponse(req, false, "Busy", NULL);
 }
 
 /**
@@ -129,127 +514,704 @@ void MessageHandler::handleRequest(char* topic, byte* payloadAsBytes, unsigned i
  */
 void MessageHandler::handleRequest(MessageHandler::MyRequest *req) {
   char dbgOut[100];
-  char jsonValues[50];
-  bool status = false;
+  IOHandler::MyValues values;
   
-  jsonValues[0]=0;
-  snprintf(dbgOut, 100, "Req %d, pin %d, waittime %d", req->req, req->pin, req->waittime);
-  Serial.println(dbgOut);
-  if(req->waittime < 0) {
-    Serial.println("Negative waittime - aborting request");
+  METRICS_SECTION(METRIC_Request);
+  LOG_INFO("Req %d, pin %d, waittime %d", req->req, req->pin, req->waittime);
+  IOHandler::IOResult result = this->executeRequest(req, dbgOut, &values, true);
+  if(result == IOHandler::IO_Pending) {
     return;
   }
-  if(req->waittime > 5000) {
-    Serial.println("Waittime changed to 5000ms");
+  bool status = result == IOHandler::IO_Ok;
+  if(req->scheduled && status && req->req == REQ_ReadValues) {
+    // Successful scheduled readings only publish the values
+    this->reportValues(req->pin, &values);
+  } else {
+    this->sendMqttResponse(req, status, dbgOut, &values);
+  }
+  statusLedShow(status ? LED_Ok : LED_Error);
+}
+
+/**
+ * Run a decoded request without responding
+ * Pending reads are answered when the sample is ready. Without canWait a
+ * read that has no fresh sample fails instead, and the pin is sampled in
+ * the background so a later read succeeds.
+ */
+IOHandler::IOResult MessageHandler::executeRequest(MessageHandler::MyRequest *req, char *text, IOHandler::MyValues *values, bool canWait) {
+  IOHandler::IOResult result = IOHandler::IO_Failed;
+  unsigned long maxAge;
+  AnalogOutput::MyStep steps[AO_MAX_STEPS];
+  int curve;
+  int count;
+
+  values->count = 0;
+  text[0] = 0;
+  const char *invalid = this->validateRequest(req);
+  if(invalid) {
+    strcpy(text, invalid);
+    return IOHandler::IO_Failed;
+  }
+  if(req->waittime < 0) {
+    LOG_WARN("Negative waittime - aborting request");
+    strcpy(text, "Negative wait time");
+    return IOHandler::IO_Failed;
+  }
+  // Fades and sequences may run longer
+  if(req->waittime > 5000 && (req->req == REQ_ToggleOnOff || req->req == REQ_ReadValues)) {
+    LOG_WARN("Waittime changed to 5000ms");
+    req->waittime = 5000;
   }
 
-  dbgOut[0] = 0;
   switch(req->req) {
     case REQ_ToggleOnOff:
-      status = this->ioHandler->runToggleOnOff(req->pin, req->waittime, dbgOut);
+      if(this->ioHandler->runToggleOnOff(req->pin, req->waittime, text)) {
+        this->pulseEncoding[req->pin] = req->encoding;
+        result = IOHandler::IO_Ok;
+      }
       break;
     case REQ_ReadValues:
-      status = this->ioHandler->runReadValues(req->pin, dbgOut, jsonValues);
+      maxAge = req->waittime > 0 ? req->waittime : SAMPLE_MAX_AGE;
+      result = this->ioHandler->runReadValues(req->pin, maxAge, text, values);
+      if(result == IOHandler::IO_Pending && !canWait) {
+        strcpy(text, "No fresh sample, try again");
+        result = IOHandler::IO_Failed;
+      } else if(result == IOHandler::IO_Pending) {
+        // Answered together with other waiting requests when the sample is ready
+        if(req->scheduled) {
+          this->pendingScheduledReads[req->pin] = true;
+        } else {
+          this->pendingReads[req->pin] |= 1 << req->encoding;
+        }
+      }
+      break;
+    case REQ_Fade:
+      // Fade;<pin>;<duration>;<level>[;<curve>]
+      curve = req->argCount > 1 ? req->args[1] : (int)AnalogOutput::CURVE_Linear;
+      if(this->ioHandler->runFade(req->pin, req->args[0], req->waittime, (AnalogOutput::Curve)curve, text)) {
+        this->pulseEncoding[req->pin] = req->encoding;
+        this->outputRequest[req->pin] = req->req;
+        result = IOHandler::IO_Ok;
+      }
       break;
+    case REQ_Sequence:
+      // Sequence;<pin>;<repeat>;<curve>;<level>;<duration>;<level>;<duration>...
+      count = (req->argCount - 1) / 2;
+      for(int i=0; i<count; i++) {
+        steps[i].level = req->args[1 + 2 * i];
+        steps[i].duration = max((int)req->args[2 + 2 * i], 0);
+      }
+      if(this->ioHandler->runSequence(req->pin, steps, count, req->waittime, (AnalogOutput::Curve)req->args[0], text)) {
+        this->pulseEncoding[req->pin] = req->encoding;
+        this->outputRequest[req->pin] = req->req;
+        result = IOHandler::IO_Ok;
+      }
+      break;
+    default:
+      strcpy(text, "Unknown request");
+  }
+  return result;
+}
+
+/**
+ * Check that the pin of a request supports it
+ * Returns NULL if it does, else the reason
+ */
+const char *MessageHandler::validateRequest(MessageHandler::MyRequest *req) {
+  IOHandler::PinConfig config = IOHandler::pinConfig(req->pin);
+  switch(req->req) {
+    case REQ_ToggleOnOff:
+      return config == IOHandler::PINCONFIG_DO ? NULL : "Pin is not configured for output";
+    case REQ_ReadValues:
+      if(config == IOHandler::PINCONFIG_None || config == IOHandler::PINCONFIG_DO) {
+        return "Pin does not support readings";
+      }
+      return NULL;
+    case REQ_Fade:
+      if(config != IOHandler::PINCONFIG_AO) {
+        return "Pin is not configured for analog output";
+      }
+      return req->argCount >= 1 ? NULL : "No level given";
+    case REQ_Sequence:
+      if(config != IOHandler::PINCONFIG_AO) {
+        return "Pin is not configured for analog output";
+      }
+      return req->argCount >= 3 && req->argCount % 2 == 1 ? NULL : "Expected a curve and level;duration steps";
     default:
-      strcpy(dbgOut, "Unknown request");
+      return "Unknown request";
+  }
+}
+
+/**
+ * Handle a batch of requests
+ * !<command>;<pin>;<waittime>|<command>;<pin>;<waittime>|...
+ * All requests are decoded and validated before any is run. With the
+ * leading '!' nothing is run unless all are valid. That is a check up
+ * front only: a request that fails while running does not undo the ones
+ * before it. Reads do not wait for a sample. The results are published
+ * on /batch, split over several messages if they do not fit in one.
+ */
+void MessageHandler::handleBatch(const char *payload, unsigned int length) {
+  MyRequest requests[MAX_BATCH_REQUESTS];
+  ParseError errors[MAX_BATCH_REQUESTS];
+  unsigned int errorPos[MAX_BATCH_REQUESTS];
+  const char *invalid[MAX_BATCH_REQUESTS];
+  const char *end = payload + length;
+  const char *pos = payload;
+  int count = 0;
+  int omitted = 0;
+  bool allValid = true;
+  bool atomic = false;
+
+  METRICS_SECTION(METRIC_Request);
+  if(pos < end && *pos == BATCH_ATOMIC) {
+    atomic = true;
+    pos++;
+  }
+  while(pos <= end) {
+    const char *next = (const char*)memchr(pos, BATCH_SEPARATOR, end - pos);
+    if(!next) {
+      next = end;
+    }
+    while(pos < next && isspace((unsigned char)*pos)) {
+      pos++;
+    }
+    if(count == MAX_BATCH_REQUESTS) {
+      LOG_WARN("Batch has more than %d requests", MAX_BATCH_REQUESTS);
+      this->sendBatchError("Too many requests in batch");
+      return;
+    }
+    errors[count] = this->decodeRequest(pos, next - pos, &requests[count], &errorPos[count]);
+    invalid[count] = errors[count] == PARSE_Ok ? this->validateRequest(&requests[count]) : parseErrorText[errors[count]];
+    if(invalid[count]) {
+      allValid = false;
+    }
+    count++;
+    pos = next + 1;
   }
-  this->sendMqttResponse(req, status, dbgOut, jsonValues);
-  this->ioHandler->flashLed(STATUSLED, status ? 2 : 5, 100);
+  LOG_INFO("Batch of %d requests%s", count, atomic ? ", all or nothing" : "");
+
+  JsonWriter batch(batchString, sizeof(batchString));
+  bool status = allValid;
+  int inMessage = 0;
+  beginBatchResults(&batch);
+  for(int i=0; i<count; i++) {
+    char text[100];
+    IOHandler::MyValues values;
+    bool ok = false;
+
+    values.count = 0;
+    if(invalid[i]) {
+      strcpy(text, invalid[i]);
+    } else if(atomic && !allValid) {
+      strcpy(text, "Not run, batch is invalid");
+    } else {
+      IOHandler::IOResult result = this->executeRequest(&requests[i], text, &values, false);
+      ok = result == IOHandler::IO_Ok;
+      status = status && ok;
+    }
+
+    json.reset();
+    json.beginObject();
+    json.addInt("req", requests[i].req);
+    json.addInt("pin", requests[i].pin);
+    json.addBool("status", ok);
+    json.addString("message", text);
+    if(errors[i] != PARSE_Ok) {
+      json.addInt("error", errors[i]);
+      json.addUnsigned("pos", errorPos[i]);
+    }
+    writeJsonValues(&json, &values);
+    json.endObject();
+    if(json.overflow()) {
+      omitted++;
+      continue;
+    }
+    // Leave room for the separator and the closing "],...}"
+    if(inMessage > 0 && batch.length() + json.length() + 1 + BATCH_RESULTS_CLOSE > sizeof(batchString)) {
+      batch.endArray();
+      batch.addBool("more", true);
+      batch.endObject();
+      this->publish(this->topicBatch, &batch);
+      beginBatchResults(&batch);
+      inMessage = 0;
+    }
+    if(batch.length() + json.length() + 1 + BATCH_RESULTS_CLOSE > sizeof(batchString)) {
+      omitted++;
+      continue;
+    }
+    batch.addRaw(NULL, json.c_str());
+    inMessage++;
+  }
+  batch.endArray();
+  batch.addBool("status", status);
+  if(omitted > 0) {
+    batch.addInt("omitted", omitted);
+  }
+  batch.endObject();
+  this->publish(this->topicBatch, &batch);
+  statusLedShow(status ? LED_Ok : LED_Error);
+}
+
+/**
+ * Report a batch that could not be handled at all
+ */
+void MessageHandler::sendBatchError(const char *text) {
+  json.reset();
+  json.beginObject();
+  writeUtcTimeField(&json);
+  json.addBool("status", false);
+  json.addString("message", text);
+  json.endObject();
+  this->publish(this->topicBatch, &json);
 }
 
 /**
  * Decode a request
+ * Single pass over the payload without copying it. On failure, errorPos
+ * is the offset of the field that could not be decoded.
  */
-bool MessageHandler::decodeRequest(char* requestAsString, MessageHandler::MyRequest *parsed) {
-  char *token = strtok(requestAsString, ";");
-  if(!token) {
-    Serial.println("No request found");
-    return false;
+MessageHandler::ParseError MessageHandler::decodeRequest(const char *payload, unsigned int length, MessageHandler::MyRequest *parsed, unsigned int *errorPos) {
+  const char *end = payload + length;
+  const char *pos = payload;
+  const char *field;
+  unsigned int fieldLength;
+
+  parsed->req = REQ_None;
+  parsed->pin = -1;
+  parsed->waittime = 0;
+  parsed->encoding = ENCODING_Text;
+  parsed->scheduled = false;
+  parsed->argCount = 0;
+
+  // Ignore trailing whitespace and newlines from command line clients
+  while(end > payload && isspace((unsigned char)end[-1])) {
+    end--;
   }
-  parsed->req = this->decodeRequestType(token);
 
-  token = strtok(NULL, ";");
-  if(!token) {
-    Serial.println("No pin number found");
-    return false;
+  *errorPos = 0;
+  if(end == payload || !nextField(&pos, end, &field, &fieldLength) || fieldLength == 0) {
+    return PARSE_NoRequest;
+  }
+  parsed->req = this->decodeRequestType(field, fieldLength);
+  if(parsed->req == REQ_None) {
+    return PARSE_UnknownRequest;
   }
-  parsed->pin = atoi(token);
 
-  token = strtok(NULL, ";");
-  if(!token) {
-    Serial.println("No wait time found");
-    return false;
+  *errorPos = pos - payload;
+  if(!nextField(&pos, end, &field, &fieldLength) || fieldLength == 0) {
+    return PARSE_NoPin;
   }
-  parsed->waittime = atoi(token);
-  return true;
+  if(!parseInt(field, fieldLength, &parsed->pin) || parsed->pin < 0 || parsed->pin > MAX_PINNUMBER) {
+    parsed->pin = -1;
+    return PARSE_InvalidPin;
+  }
+
+  *errorPos = pos - payload;
+  if(!nextField(&pos, end, &field, &fieldLength) || fieldLength == 0) {
+    return PARSE_NoWaittime;
+  }
+  if(!parseInt(field, fieldLength, &parsed->waittime)) {
+    return PARSE_InvalidWaittime;
+  }
+
+  int maxArgs = maxRequestArgs(parsed->req);
+  while(pos <= end && parsed->argCount < maxArgs) {
+    int arg;
+    *errorPos = pos - payload;
+    nextField(&pos, end, &field, &fieldLength);
+    if(!parseInt(field, fieldLength, &arg)) {
+      return PARSE_InvalidArgument;
+    }
+    parsed->args[parsed->argCount++] = arg;
+  }
+
+  *errorPos = pos - payload;
+  if(pos <= end) {
+    return PARSE_TrailingData;
+  }
+  return PARSE_Ok;
 }
 
 /**
  * Decode a request type from string
  */
-MessageHandler::MyRequestType MessageHandler::decodeRequestType(const char *req) {
-  if(strcmp(req, "ToggleOnOff") == 0) {
-    return REQ_ToggleOnOff;
-  } else if(strcmp(req, "ReadValues") == 0) {
-    return REQ_ReadValues;
+MessageHandler::MyRequestType MessageHandler::decodeRequestType(const char *name, unsigned int length) {
+  const char *expected = NULL;
+  MyRequestType type = REQ_None;
+
+  switch(hashCommand(name, length)) {
+#define COMMAND_CASE(reqType, reqName, reqArgs) \
+    case commandNameHash(reqName): \
+      expected = reqName; \
+      type = reqType; \
+      break;
+    REQUEST_COMMANDS(COMMAND_CASE)
+#undef COMMAND_CASE
+    default:
+      return REQ_None;
+  }
+  if(strlen(expected) != length || memcmp(expected, name, length) != 0) {
+    return REQ_None;
   }
-  return REQ_None;
+  return type;
 }
 
 
 /**
  * Send a status report to the MQTT broker
  */
-void MessageHandler::sendMqttResponse(MessageHandler::MyRequest *req, bool status, const char *text, const char *jsonValues) {
-  char respTopic[20];
-  
-  snprintf (genericString, 150, "{%s\"req\":%d,\"status\":%s,\"message\":\"%s\"}", 
-    getCurrentUtcTimeAsJsonField(), req->req, status ? "true" : "false", text);
-  String topic = String(this->mqttBaseTopic);
-  snprintf (respTopic, 20, "/response/%d", req->pin);
-  topic.concat(respTopic);
-  Serial.print("Publish message to ");
-  Serial.print(topic.c_str());
-  Serial.print(": ");
-  Serial.println(genericString);    
-  if(this->mqtt->publish(topic.c_str(), genericString) == 0) {
-    Serial.println("MessageHandler: Failed to publish to mqtt. Too long message?");
+void MessageHandler::sendMqttResponse(MessageHandler::MyRequest *req, bool status, const char *text, const IOHandler::MyValues *values) {
+  if(req->encoding == ENCODING_Binary) {
+    this->sendBinaryResponse(req, status ? BINARY_STATUS_OK : BINARY_STATUS_FAILED, text, values);
+    return;
+  }
+
+  json.reset();
+  json.beginObject();
+  writeUtcTimeField(&json);
+  json.addInt("req", req->req);
+  json.addBool("status", status);
+  json.addString("message", text);
+  json.endObject();
+  if(req->pin < 0 || req->pin > MAX_PINNUMBER) {
+    this->publish(this->topicError, &json);
+    return;
+  }
+  this->publish(this->topicResponse[req->pin], &json);
+
+  this->sendValues(req->pin, values);
+}
+
+/**
+ * Send a values message for a pin
+ */
+void MessageHandler::sendValues(int pin, const IOHandler::MyValues *values) {
+  if(!values || values->count == 0) {
+    return;
+  }
+  json.reset();
+  json.beginObject();
+  writeUtcTimeField(&json);
+  writeJsonValues(&json, values);
+  json.endObject();
+  if(!this->publish(this->topicValues[pin], &json)) {
+    this->bufferValues(pin, values);
+  }
+}
+
+/**
+ * Send a binary response frame
+ * Values are merged into the same frame, so there is one publish per request
+ */
+void MessageHandler::sendBinaryResponse(MessageHandler::MyRequest *req, byte status, const char *text, const IOHandler::MyValues *values) {
+  byte frame[100];
+
+  unsigned int length = encodeBinaryResponse(frame, sizeof(frame), req, status, text, values, getCurrentUtcTime());
+  if(length == 0) {
+    LOG_ERROR("MessageHandler: Binary response does not fit");
+    return;
+  }
+  bool validPin = req->pin >= 0 && req->pin <= MAX_PINNUMBER;
+  if(!this->publish(validPin ? this->topicBinary[req->pin] : this->topicBinaryError, frame, length) && validPin) {
+    this->bufferValues(req->pin, values);
+  }
+}
+
+/**
+ * Send values if the report policy of the pin allows it
+ */
+void MessageHandler::reportValues(int pin, const IOHandler::MyValues *values) {
+  MyReportState *report = &this->reports[pin];
+  unsigned long now = millis();
+
+  if(report->enabled && report->reported) {
+    unsigned long elapsed = now - report->reportedAt;
+    if(elapsed < report->policy.minInterval) {
+      return;
+    }
+    bool heartbeat = report->policy.maxInterval > 0 && elapsed >= report->policy.maxInterval;
+    if(!heartbeat && !this->valuesChanged(report, values)) {
+      return;
+    }
+  }
+  report->reported = true;
+  report->reportedAt = now;
+  report->values = *values;
+  this->sendValues(pin, values);
+}
+
+/**
+ * Check if any value has moved outside the deadband
+ * The age and timing values of a reading are not compared
+ */
+bool MessageHandler::valuesChanged(MyReportState *report, const IOHandler::MyValues *values) {
+  for(int i=0; i<values->count; i++) {
+    const IOHandler::MyValue *value = &values->value[i];
+    if(value->type == IOHandler::VALUE_Age || value->type == IOHandler::VALUE_Jitter || value->type == IOHandler::VALUE_Cpu) {
+      continue;
+    }
+    const IOHandler::MyValue *last = NULL;
+    for(int j=0; j<report->values.count; j++) {
+      if(report->values.value[j].type == value->type) {
+        last = &report->values.value[j];
+        break;
+      }
+    }
+    if(!last) {
+      return true;
+    }
+    long change = labs(value->value - last->value);
+    long deadband = max(report->policy.deadband, labs(last->value) * report->policy.deadbandPercent / 100);
+    if(change > deadband) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Keep values that could not be published until the broker is reachable
+ */
+void MessageHandler::bufferValues(int pin, const IOHandler::MyValues *values) {
+  if(!values || values->count == 0) {
+    return;
   }
+  this->telemetry.push(millis(), pin, values);
+  LOG_DEBUG("Buffered values for pin %d, %d readings waiting", pin, this->telemetry.count());
+}
+
+/**
+ * Publish a batch of buffered readings
+ * Readings are removed only after the batch is published. One batch per
+ * TELEMETRY_FLUSH_INTERVAL, so a backlog does not flood the broker. The
+ * time of a reading is its age subtracted from the UTC time now.
+ */
+void MessageHandler::flushTelemetry() {
+  TelemetryBuffer::MyReading reading;
+  unsigned long now = millis();
+  int count = 0;
 
-  if(jsonValues[0] != 0) {
-    snprintf (genericString, 150, "{\"time\":%ld,%s}", getCurrentUtcTime(), jsonValues);
-    topic = String(this->mqttBaseTopic);
-    snprintf (respTopic, 20, "/values/%d", req->pin);
-    topic.concat(respTopic);
-    Serial.print("Publish message to ");
-    Serial.print(topic.c_str());
-    Serial.print(": ");
-    Serial.println(genericString);    
-    if(this->mqtt->publish(topic.c_str(), genericString) == 0) {
-      Serial.println("MessageHandler: Failed to publish to mqtt. Too long message?");
+  JsonWriter batch(batchString, sizeof(batchString));
+  batch.beginObject();
+  batch.addUnsigned("dropped", this->telemetry.dropped());
+  batch.beginArray("readings");
+  while(count < TELEMETRY_BATCH_SIZE && this->telemetry.peek(count, &reading)) {
+    json.reset();
+    json.beginObject();
+    writeUtcTimeField(&json, now - reading.takenAt);
+    json.addInt("pin", reading.pin);
+    writeJsonValues(&json, &reading.values);
+    json.endObject();
+    if(json.overflow()) {
+      // Can never be published, so it would block the rest
+      if(count == 0) {
+        LOG_ERROR("MessageHandler: Buffered reading for pin %d does not fit in %u bytes", reading.pin, sizeof(genericString));
+        this->telemetry.pop(1);
+      }
+      break;
+    }
+    // Leave room for the separator and the closing "]}"
+    if(batch.length() + json.length() + 3 >= sizeof(batchString)) {
+      break;
     }
+    batch.addRaw(NULL, json.c_str());
+    count++;
+  }
+  batch.endArray();
+  batch.endObject();
+  if(count > 0 && this->publish(this->topicBuffered, &batch)) {
+    this->telemetry.pop(count);
   }
 }
 
+/**
+ * Report a request that could not be decoded
+ * Published on the response topic of the pin if it was decoded, else on /error
+ */
+void MessageHandler::sendParseError(MessageHandler::MyRequest *req, ParseError error, unsigned int errorPos) {
+  if(req->encoding == ENCODING_Binary) {
+    this->sendBinaryResponse(req, BINARY_STATUS_PARSE_ERROR | error, parseErrorText[error], NULL);
+    return;
+  }
+
+  json.reset();
+  json.beginObject();
+  writeUtcTimeField(&json);
+  json.addInt("req", req->req);
+  json.addBool("status", false);
+  json.addString("message", parseErrorText[error]);
+  json.addInt("error", error);
+  json.addUnsigned("pos", errorPos);
+  json.endObject();
+  this->publish(req->pin >= 0 ? this->topicResponse[req->pin] : this->topicError, &json);
+}
+
 /**
  * Loop function
  */
 void MessageHandler::loop() {
-  static long lastTimeStatusToMqtt = 0;
-  long now = millis();
-  if ((abs(now - lastTimeStatusToMqtt) > 30000) || (lastTimeStatusToMqtt == 0)) {
+  unsigned long now = millis();
+  if(now - this->lastAliveMessage >= this->aliveWait) {
     static int aboutCounter = 10;
-    lastTimeStatusToMqtt = now;
-    this->sendAliveMessage();
-    aboutCounter++;
-    if(aboutCounter >= 10) {
-      aboutCounter = 0;
-      this->sendAboutMessage();
+    this->lastAliveMessage = now;
+    if(!this->sendAliveMessage()) {
+      // Try again soon, the boot times are kept until it is published
+      this->aliveWait = ALIVE_RETRY_INTERVAL;
+    } else {
+      this->aliveSent = true;
+      this->aliveWait = ALIVE_INTERVAL;
+#ifdef ENABLE_METRICS
+      this->sendMetricsMessage();
+#endif
+      aboutCounter++;
+      if(aboutCounter >= 10) {
+        aboutCounter = 0;
+        this->sendAboutMessage();
+      }
     }
   }
 
+  /* Forward readings buffered while the broker was unreachable */
+  if(this->telemetry.count() > 0 && now - this->lastTelemetryFlush >= TELEMETRY_FLUSH_INTERVAL && utcTimeReady()) {
+    this->lastTelemetryFlush = now;
+    this->flushTelemetry();
+  }
+
+  this->sampleLoop();
+}
+
+/**
+ * Handle IO events, received requests and scheduled requests
+ * Called while waiting for WiFi or MQTT, so sampling continues during
+ * outages. Values that cannot be published are buffered.
+ */
+void MessageHandler::sampleLoop() {
+  /* Report finished pulses and new samples */
+  IOHandler::IOEvent event;
+  while(this->ioHandler->pollEvent(&event)) {
+    this->handleIOEvent(&event);
+  }
+
+  /* Run received requests */
+  this->runQueuedRequests();
+
   /* Check if time to send something */
   this->executeScheduledRequests();
 }
 
+/**
+ * Send a response for an asynchronous IO event
+ */
+void MessageHandler::handleIOEvent(IOHandler::IOEvent *event) {
+  MessageHandler::MyRequest req;
+  IOHandler::MyValues values;
+  char text[50];
+  bool status;
+
+  req.scheduled = false;
+  req.argCount = 0;
+  switch(event->type) {
+    case IOHandler::IOEVENT_PulseFinished:
+      req.req = REQ_ToggleOnOff;
+      req.pin = event->pin;
+      req.waittime = 0;
+      req.encoding = this->pulseEncoding[event->pin];
+      this->sendMqttResponse(&req, true, "Pulse finished", NULL);
+      break;
+    case IOHandler::IOEVENT_SampleReady:
+      req.req = REQ_ReadValues;
+      req.pin = event->pin;
+      req.waittime = 0;
+      values.count = 0;
+      status = this->ioHandler->runReadValues(event->pin, IOHandler::ANY_AGE, text, &values) == IOHandler::IO_Ok;
+      for(int encoding=ENCODING_Text; encoding<=ENCODING_Binary; encoding++) {
+        if(this->pendingReads[event->pin] & (1 << encoding)) {
+          req.encoding = (MyEncoding)encoding;
+          this->sendMqttResponse(&req, status, text, &values);
+        }
+      }
+      if(this->pendingScheduledReads[event->pin]) {
+        if(status) {
+          this->reportValues(event->pin, &values);
+        } else {
+          req.scheduled = true;
+          req.encoding = ENCODING_Text;
+          this->sendMqttResponse(&req, status, text, &values);
+        }
+      }
+      this->pendingReads[event->pin] = 0;
+      this->pendingScheduledReads[event->pin] = false;
+      break;
+    case IOHandler::IOEVENT_OutputFinished:
+      req.req = this->outputRequest[event->pin];
+      req.pin = event->pin;
+      req.waittime = 0;
+      req.encoding = this->pulseEncoding[event->pin];
+      this->sendMqttResponse(&req, true, req.req == REQ_Sequence ? "Sequence finished" : "Fade finished", NULL);
+      break;
+    case IOHandler::IOEVENT_InputChanged:
+      this->sendInputEvent(event);
+      break;
+    case IOHandler::IOEVENT_WindowReady:
+      // Analog windows are published without a request
+      values.count = 0;
+      if(this->ioHandler->runReadValues(event->pin, IOHandler::ANY_AGE, text, &values) == IOHandler::IO_Ok) {
+        this->reportValues(event->pin, &values);
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+/**
+ * Publish a digital input edge, timestamped at the interrupt
+ */
+void MessageHandler::sendInputEvent(IOHandler::IOEvent *event) {
+  IOHandler::MyValues values;
+  unsigned long age = (micros() - event->micros) / 1000;
+
+  values.value[0].type = IOHandler::VALUE_Level;
+  values.value[0].value = event->level;
+  values.value[1].type = IOHandler::VALUE_Count;
+  values.value[1].value = event->count;
+  values.count = 2;
+
+  json.reset();
+  json.beginObject();
+  writeUtcTimeField(&json, age);
+  writeJsonValues(&json, &values);
+  json.endObject();
+  if(!this->publish(this->topicEvent[event->pin], &json)) {
+    this->telemetry.push(millis() - age, event->pin, &values);
+  }
+}
+
+/**
+ * Milliseconds until loop() has something to do
+ */
+unsigned long MessageHandler::millisToNextEvent() {
+  unsigned long now = millis();
+  unsigned long wait = (unsigned long)-1;
+  unsigned long deadline;
+
+  if(this->queuedRequests > 0) {
+    return 0;
+  }
+  // Alive messages and buffered readings wait until the broker is reachable
+  if(this->mqtt->connected()) {
+    wait = this->aliveWait - min(now - this->lastAliveMessage, this->aliveWait);
+    if(this->telemetry.count() > 0) {
+      wait = min(wait, TELEMETRY_FLUSH_INTERVAL - min(now - this->lastTelemetryFlush, TELEMETRY_FLUSH_INTERVAL));
+    }
+  }
+  if(this->scheduler.nextDeadline(&deadline)) {
+    if((long)(deadline - now) <= 0) {
+      wait = 0;
+    } else {
+      wait = min(wait, deadline - now);
+    }
+  }
+  return wait;
+}
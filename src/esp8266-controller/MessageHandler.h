@@ -3,48 +3,139 @@
 #include <Arduino.h>
 #include <PubSubClient.h>
 #include "IOHandler.h"
+#include "Scheduler.h"
+#include "JsonWriter.h"
+#include "TelemetryBuffer.h"
 
 class MessageHandler {
   public:    
     enum MyRequestType {
       REQ_None,
       REQ_ToggleOnOff,
-      REQ_ReadValues
+      REQ_ReadValues,
+      REQ_Fade,
+      REQ_Sequence,
+      REQ_Count
+    };
+    enum MyEncoding {
+      ENCODING_Text,
+      ENCODING_Binary
     };
     struct MyRequest {
       MyRequestType req;
       int           pin;
       int           waittime;
+      MyEncoding    encoding;
+      bool          scheduled; // Set by addScheduledRequest()
+      int           argCount;
+      short         args[MAX_REQUEST_ARGS]; // Fields after the wait time
     };
-  
-  private:  
-    struct ScheduledItem {
-      bool          active;
-      MyRequest     req;
-      unsigned long lastExecuted;
-      unsigned long interval;
+    /*
+     * Report-by-exception policy for scheduled readings of a pin
+     * A reading is published when a value moves more than the deadband
+     * from the last published one, but not more often than minInterval.
+     * After maxInterval it is published anyway. 0 disables a limit.
+     */
+    struct MyReportPolicy {
+      long          deadband;        // Absolute, in the fixed point unit of each value
+      int           deadbandPercent; // Relative to the last published value
+      unsigned long minInterval;     // ms
+      unsigned long maxInterval;     // ms
+    };
+    enum ParseError {
+      PARSE_Ok,
+      PARSE_NoRequest,
+      PARSE_UnknownRequest,
+      PARSE_NoPin,
+      PARSE_InvalidPin,
+      PARSE_NoWaittime,
+      PARSE_InvalidWaittime,
+      PARSE_TrailingData,
+      PARSE_InvalidArgument
     };
   
+  private:  
     PubSubClient *mqtt;
     const char *mqttBaseTopic;
     IOHandler *ioHandler;
-    ScheduledItem schedules[10];
-    int activeSchedules;
+    MyEncoding pulseEncoding[MAX_PINNUMBER+1]; // Encoding of the request that started a pulse or fade
+    MyRequestType outputRequest[MAX_PINNUMBER+1]; // Request that started a fade or sequence
+    byte pendingReads[MAX_PINNUMBER+1]; // Encodings waiting for a sample
+    bool pendingScheduledReads[MAX_PINNUMBER+1];
+    struct MyReportState {
+      bool                enabled;
+      bool                reported;
+      unsigned long       reportedAt;
+      MyReportPolicy      policy;
+      IOHandler::MyValues values;
+    };
+    MyReportState reports[MAX_PINNUMBER+1];
+    char topicAlive[MAX_TOPIC_LENGTH];
+    char topicAbout[MAX_TOPIC_LENGTH];
+#ifdef ENABLE_METRICS
+    char topicMetrics[MAX_TOPIC_LENGTH];
+#endif
+    char topicError[MAX_TOPIC_LENGTH];
+    char topicBinaryError[MAX_TOPIC_LENGTH];
+    char topicResponse[MAX_PINNUMBER+1][MAX_TOPIC_LENGTH];
+    char topicValues[MAX_PINNUMBER+1][MAX_TOPIC_LENGTH];
+    char topicBinary[MAX_PINNUMBER+1][MAX_TOPIC_LENGTH];
+    char topicEvent[MAX_PINNUMBER+1][MAX_TOPIC_LENGTH];
+    char topicBuffered[MAX_TOPIC_LENGTH];
+    char topicBatch[MAX_TOPIC_LENGTH];
+    Scheduler scheduler;
+    MyRequest scheduledRequests[MAX_SCHEDULES];
+    unsigned long lastAliveMessage;
+    unsigned long aliveWait; // ms from lastAliveMessage to the next alive message
+    bool aliveSent;
+    TelemetryBuffer telemetry;
+    MyRequest requestQueue[REQUEST_QUEUE_SIZE]; // In arrival order
+    int queuedRequests;
+    unsigned long lastTelemetryFlush;
     
     
-    bool decodeRequest(char* requestAsString, MessageHandler::MyRequest *parsed);
-    MyRequestType decodeRequestType(const char *req);
-    void sendMqttResponse(MessageHandler::MyRequest *req, bool status, const char *text, const char *jsonValues);
-    void sendAliveMessage();
+    ParseError decodeRequest(const char *payload, unsigned int length, MessageHandler::MyRequest *parsed, unsigned int *errorPos);
+    MyRequestType decodeRequestType(const char *name, unsigned int length);
+    IOHandler::IOResult executeRequest(MessageHandler::MyRequest *req, char *text, IOHandler::MyValues *values, bool canWait);
+    const char *validateRequest(MessageHandler::MyRequest *req);
+    void handleBatch(const char *payload, unsigned int length);
+    void sendBatchError(const char *text);
+    bool queueRequest(MessageHandler::MyRequest *req);
+    void removeQueuedRequest(int index);
+    void runQueuedRequests();
+    void sendBusyResponse(MessageHandler::MyRequest *req);
+    static bool isControlRequest(MessageHandler::MyRequest *req);
+    void sendMqttResponse(MessageHandler::MyRequest *req, bool status, const char *text, const IOHandler::MyValues *values);
+    void sendBinaryResponse(MessageHandler::MyRequest *req, byte status, const char *text, const IOHandler::MyValues *values);
+    void sendParseError(MessageHandler::MyRequest *req, ParseError error, unsigned int errorPos);
+    void buildTopic(char *topic, const char *suffix, int pin);
+    bool publish(const char *topic, JsonWriter *json);
+    bool publish(const char *topic, const byte *frame, unsigned int length);
+    bool sendAliveMessage();
     void sendAboutMessage();
+#ifdef ENABLE_METRICS
+    void sendMetricsMessage();
+#endif
+    void handleIOEvent(IOHandler::IOEvent *event);
+    void sendInputEvent(IOHandler::IOEvent *event);
+    void sendValues(int pin, const IOHandler::MyValues *values);
+    void reportValues(int pin, const IOHandler::MyValues *values);
+    bool valuesChanged(MyReportState *report, const IOHandler::MyValues *values);
+    void bufferValues(int pin, const IOHandler::MyValues *values);
+    void flushTelemetry();
     
   public:
     MessageHandler(PubSubClient *mqtt, const char* mqttBaseTopic, IOHandler *ioHandler);
+    void setup();
     void handleRequest(char* topic, byte* payloadAsBytes, unsigned int length);
     void handleRequest(MessageHandler::MyRequest *req);
-    bool addScheduledRequest(MyRequest *req, unsigned long interval);
+    int addScheduledRequest(MyRequest *req, unsigned long interval);
+    bool removeScheduledRequest(int id);
+    bool setReportPolicy(int pin, MyReportPolicy *policy);
     bool executeScheduledRequests();
     void loop();
+    void sampleLoop();
+    unsigned long millisToNextEvent();
     
 };
 #endif
@@ -0,0 +1,151 @@
+/*
+ * Metrics
+ * Timing histograms and counters for the main loop.
+ * Everything is compiled out unless ENABLE_METRICS is defined.
+ *
+ * @author Steinar Thorshaug
+ */
+#include "Metrics.h"
+#ifdef ENABLE_METRICS
+#include "JsonWriter.h"
+
+/*
+ * Histogram buckets grow by a factor 4:
+ * <64us, <256us, <1ms, <4ms, <16ms, <64ms, <256ms, >=256ms
+ */
+const int METRICS_BUCKETS = 8;
+
+struct MySection {
+  unsigned long count;
+  unsigned long total;
+  unsigned long longest;
+  unsigned long buckets[METRICS_BUCKETS];
+};
+
+static const char *sectionNames[METRIC_SectionCount] = { "mqtt", "time", "msg", "req", "read" };
+static MySection sections[METRIC_SectionCount];
+static unsigned long counters[COUNTER_Count];
+static long gauges[GAUGE_Count];
+static unsigned long loopStarted = 0;
+static unsigned long loops = 0;
+static unsigned long longestLoop = 0;
+static unsigned long minFreeHeap = 0;
+static unsigned long overheadNs = 0;
+
+/**
+ * Clear the timing window
+ */
+static void resetWindow() {
+  memset(sections, 0, sizeof(sections));
+  loops = 0;
+  longestLoop = 0;
+}
+
+/**
+ * Reset all metrics and measure the cost of one timed section
+ */
+void metricsInit() {
+  const int rounds = 100;
+  memset(counters, 0, sizeof(counters));
+  memset(gauges, 0, sizeof(gauges));
+  unsigned long started = micros();
+  for(int i=0; i<rounds; i++) {
+    METRICS_SECTION(METRIC_MqttLoop);
+  }
+  overheadNs = (micros() - started) * 1000 / rounds;
+  resetWindow();
+  minFreeHeap = ESP.getFreeHeap();
+}
+
+/**
+ * Add a duration to the histogram of a section
+ */
+void metricsRecord(MetricsSection section, unsigned long micros) {
+  MySection *s = &sections[section];
+  int bucket = 0;
+  unsigned long limit = 64;
+  while(bucket < METRICS_BUCKETS - 1 && micros >= limit) {
+    bucket++;
+    limit <<= 2;
+  }
+  s->count++;
+  s->total += micros;
+  s->buckets[bucket]++;
+  if(micros > s->longest) {
+    s->longest = micros;
+  }
+}
+
+void metricsCount(MetricsCounter counter) {
+  counters[counter]++;
+}
+
+/**
+ * Set a gauge
+ */
+void metricsSet(MetricsGauge gauge, long value) {
+  gauges[gauge] = value;
+}
+
+void metricsLoopStart() {
+  loopStarted = micros();
+}
+
+/**
+ * Record the busy time of one loop iteration and sample the heap
+ */
+void metricsLoopEnd() {
+  unsigned long busy = micros() - loopStarted;
+  loops++;
+  if(busy > longestLoop) {
+    longestLoop = busy;
+  }
+  unsigned long freeHeap = ESP.getFreeHeap();
+  if(freeHeap < minFreeHeap) {
+    minFreeHeap = freeHeap;
+  }
+}
+
+/**
+ * Write all metrics as JSON fields and start a new timing window
+ * Each section is [count, average us, max us, histogram...]
+ */
+void metricsWriteJson(JsonWriter *json) {
+  json->addUnsigned("loops", loops);
+  json->addUnsigned("stall", longestLoop);
+  json->addUnsigned("heap", ESP.getFreeHeap());
+  json->addUnsigned("minheap", minFreeHeap);
+  json->addUnsigned("maxblock", ESP.getMaxFreeBlockSize());
+  json->beginArray("pub");
+  json->addUnsigned(NULL, counters[COUNTER_PublishOk]);
+  json->addUnsigned(NULL, counters[COUNTER_PublishFailed]);
+  json->endArray();
+  json->beginArray("reconn");
+  json->addUnsigned(NULL, counters[COUNTER_MqttReconnect]);
+  json->addUnsigned(NULL, counters[COUNTER_WifiReconnect]);
+  json->endArray();
+  json->beginArray("conn");
+  json->addInt(NULL, gauges[GAUGE_ConnectionState]);
+  json->addUnsigned(NULL, counters[COUNTER_ConnectionChange]);
+  json->addUnsigned(NULL, counters[COUNTER_MqttConnectFailed]);
+  json->endArray();
+  json->beginArray("rq");
+  json->addInt(NULL, gauges[GAUGE_RequestQueueDepth]);
+  json->addUnsigned(NULL, counters[COUNTER_RequestBusy]);
+  json->addUnsigned(NULL, counters[COUNTER_RequestMerged]);
+  json->endArray();
+  json->addUnsigned("ovh", overheadNs);
+  for(int i=0; i<METRIC_SectionCount; i++) {
+    MySection *s = &sections[i];
+    json->beginArray(sectionNames[i]);
+    json->addUnsigned(NULL, s->count);
+    json->addUnsigned(NULL, s->count ? s->total / s->count : 0);
+    json->addUnsigned(NULL, s->longest);
+    for(int b=0; b<METRICS_BUCKETS; b++) {
+      json->addUnsigned(NULL, s->buckets[b]);
+    }
+    json->endArray();
+  }
+  resetWindow();
+}
+#endif
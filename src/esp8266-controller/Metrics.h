@@ -0,0 +1,85 @@
+#ifndef Metrics_h
+#define Metrics_h
+#include <Arduino.h>
+#include "myconstants.h"
+
+class JsonWriter;
+
+/*
+ * Timed sections of the main loop
+ */
+enum MetricsSection {
+  METRIC_MqttLoop,
+  METRIC_TimeController,
+  METRIC_MessageHandler,
+  METRIC_Request,
+  METRIC_SensorRead,
+  METRIC_SectionCount
+};
+
+/*
+ * Event counters
+ */
+enum MetricsCounter {
+  COUNTER_PublishOk,
+  COUNTER_PublishFailed,
+  COUNTER_MqttReconnect,
+  COUNTER_WifiReconnect,
+  COUNTER_MqttConnectFailed,
+  COUNTER_ConnectionChange,
+  COUNTER_RequestBusy,
+  COUNTER_RequestMerged,
+  COUNTER_Count
+};
+
+/*
+ * Last reported values
+ */
+enum MetricsGauge {
+  GAUGE_ConnectionState,
+  GAUGE_RequestQueueDepth,
+  GAUGE_Count
+};
+
+#ifdef ENABLE_METRICS
+void metricsInit();
+void metricsRecord(MetricsSection section, unsigned long micros);
+void metricsCount(MetricsCounter counter);
+void metricsSet(MetricsGauge gauge, long value);
+void metricsLoopStart();
+void metricsLoopEnd();
+void metricsWriteJson(JsonWriter *json);
+
+/*
+ * Times the enclosing scope
+ */
+class MetricsTimer {
+  public:
+    MetricsTimer(MetricsSection section) {
+      this->section = section;
+      this->started = micros();
+    };
+    ~MetricsTimer() {
+      metricsRecord(this->section, micros() - this->started);
+    };
+  private:
+    MetricsSection section;
+    unsigned long started;
+};
+
+#define METRICS_CONCAT2(a, b) a##b
+#define METRICS_CONCAT(a, b) METRICS_CONCAT2(a, b)
+#define METRICS_SECTION(section) MetricsTimer METRICS_CONCAT(metricsTimer, __LINE__)(section)
+#define METRICS_COUNT(counter) metricsCount(counter)
+#define METRICS_SET(gauge, value) metricsSet(gauge, value)
+#define METRICS_LOOP_START() metricsLoopStart()
+#define METRICS_LOOP_END() metricsLoopEnd()
+#else
+#define METRICS_SECTION(section) do {} while(0)
+#define METRICS_COUNT(counter) do {} while(0)
+#define METRICS_SET(gauge, value) do {} while(0)
+#define METRICS_LOOP_START() do {} while(0)
+#define METRICS_LOOP_END() do {} while(0)
+#endif
+
+#endif
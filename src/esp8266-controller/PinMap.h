@@ -0,0 +1,97 @@
+#ifndef PinMap_h
+#define PinMap_h
+#include "myconstants.h"
+#include "IOHandler.h"
+
+/*
+ * Compile time view of PIN_MAP in myconstants.h
+ * Invalid maps are rejected by static_assert, and the per pin
+ * configuration is a constant table indexed by pin number.
+ */
+struct PinMapEntry {
+  int                  pin;
+  IOHandler::PinConfig config;
+};
+
+#define PIN_MAP_ENTRY(pin, config) { pin, IOHandler::config },
+static constexpr PinMapEntry pinMap[] = {
+  PIN_MAP(PIN_MAP_ENTRY)
+  { -1, IOHandler::PINCONFIG_None } // End of the map
+};
+#undef PIN_MAP_ENTRY
+
+static constexpr int PIN_MAP_SIZE = sizeof(pinMap) / sizeof(pinMap[0]) - 1;
+
+/**
+ * Configuration of a pin, PINCONFIG_None if it is not in the map
+ */
+static constexpr IOHandler::PinConfig pinMapConfig(int pin, int i = 0) {
+  return i >= PIN_MAP_SIZE ? IOHandler::PINCONFIG_None :
+         pinMap[i].pin == pin ? pinMap[i].config : pinMapConfig(pin, i + 1);
+}
+
+/**
+ * Number of map entries for a pin
+ */
+static constexpr int pinMapEntries(int pin, int i = 0) {
+  return i >= PIN_MAP_SIZE ? 0 : (pinMap[i].pin == pin ? 1 : 0) + pinMapEntries(pin, i + 1);
+}
+
+/**
+ * Number of pins with a configuration
+ */
+static constexpr int pinMapCount(IOHandler::PinConfig config, int i = 0) {
+  return i >= PIN_MAP_SIZE ? 0 : (pinMap[i].config == config ? 1 : 0) + pinMapCount(config, i + 1);
+}
+
+/**
+ * Check that all pins are in range, usable and assigned once
+ * GPIO 6 to 11 are connected to the flash chip
+ */
+static constexpr bool pinMapPinsValid(int i = 0) {
+  return i >= PIN_MAP_SIZE ||
+         (pinMap[i].pin >= 0 && pinMap[i].pin <= MAX_PINNUMBER &&
+          (pinMap[i].pin < 6 || pinMap[i].pin > 11) &&
+          pinMapEntries(pinMap[i].pin) == 1 &&
+          pinMapPinsValid(i + 1));
+}
+
+/**
+ * Check if the GPIO of a pin number is used
+ * The analog input is A0 and does not use the GPIO of its pin number
+ */
+static constexpr bool pinMapGpioUsed(int pin) {
+  return pinMapEntries(pin) > 0 && pinMapConfig(pin) != IOHandler::PINCONFIG_AI;
+}
+
+static_assert(pinMapPinsValid(), "PIN_MAP: pin out of range, connected to the flash or assigned twice");
+static_assert(!pinMapGpioUsed(STATUSLED), "PIN_MAP: STATUSLED is the status LED and can not be used");
+static_assert(!pinMapGpioUsed(1) && !pinMapGpioUsed(3), "PIN_MAP: GPIO 1 and 3 are the serial TX and RX used by the log");
+static_assert(pinMapCount(IOHandler::PINCONFIG_AI) <= 1, "PIN_MAP: the ESP8266 has a single analog input");
+#ifndef EXTLIB_DHT22
+static_assert(pinMapCount(IOHandler::PINCONFIG_DHT22) == 0, "PIN_MAP: PINCONFIG_DHT22 requires EXTLIB_DHT22");
+#endif
+#ifndef EXTLIB_ONEWIRE
+static_assert(pinMapCount(IOHandler::PINCONFIG_DS18B20) == 0, "PIN_MAP: PINCONFIG_DS18B20 requires EXTLIB_ONEWIRE");
+#endif
+static_assert(pinMapCount(IOHandler::PINCONFIG_SHT31) <= 1, "PIN_MAP: a single SHT31 is supported, they share the I2C address");
+static_assert(pinMapCount(IOHandler::PINCONFIG_SHT31) == 0 || pinMapEntries(I2C_SCL_PIN) == 0, "PIN_MAP: I2C_SCL_PIN is the SHT31 clock and can not be used");
+
+/*
+ * Configuration of every pin number, generated from the map
+ */
+template <int... Pins>
+struct PinConfigList {
+  static constexpr IOHandler::PinConfig configs[sizeof...(Pins)] = { pinMapConfig(Pins)... };
+};
+template <int... Pins>
+constexpr IOHandler::PinConfig PinConfigList<Pins...>::configs[sizeof...(Pins)];
+
+template <int N, int... Pins>
+struct MakePinConfigTable : MakePinConfigTable<N - 1, N - 1, Pins...> {};
+template <int... Pins>
+struct MakePinConfigTable<0, Pins...> : PinConfigList<Pins...> {};
+
+typedef MakePinConfigTable<MAX_PINNUMBER + 1> PinConfigs;
+
+#endif
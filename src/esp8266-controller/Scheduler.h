@@ -0,0 +1,168 @@
+#ifndef Scheduler_h
+#define Scheduler_h
+#include <Arduino.h>
+#include "myconstants.h"
+
+/*
+ * Deadline scheduler for periodic jobs
+ * Keeps a min-heap of job ids ordered on the next deadline, with room for
+ * N jobs. Deadlines are compared by their signed difference, so the
+ * millis() wrap after 49 days is harmless.
+ */
+template <int N>
+class SchedulerT {
+  public:
+    SchedulerT() {
+      for(int i=0; i<N; i++) {
+        this->entries[i].active = false;
+      }
+      this->heapSize = 0;
+    };
+
+    /**
+     * Add a periodic job
+     * Jobs with the same interval get different phases, so they don't all
+     * become due in the same loop. Returns the job id or -1 if full.
+     */
+    int add(unsigned long interval) {
+      int id = -1;
+      int sameInterval = 0;
+      for(int i=0; i<N; i++) {
+        if(!this->entries[i].active) {
+          if(id < 0) id = i;
+        } else if(this->entries[i].interval == interval) {
+          sameInterval++;
+        }
+      }
+      if(id < 0 || interval == 0) {
+        return -1;
+      }
+      // Golden ratio spread of the phase: 40503/65536 ~ 0.618
+      unsigned long phase = (unsigned long)(((uint64_t)interval * (((sameInterval+1) * 40503UL) & 0xFFFF)) >> 16);
+      MyEntry *entry = &this->entries[id];
+      entry->active = true;
+      entry->interval = interval;
+      entry->deadline = millis() + phase;
+      entry->heapIndex = this->heapSize;
+      this->heap[this->heapSize] = id;
+      this->heapSize++;
+      this->siftUp(entry->heapIndex);
+      return id;
+    };
+
+    /**
+     * Remove a job
+     */
+    bool remove(int id) {
+      if(id < 0 || id >= N || !this->entries[id].active) {
+        return false;
+      }
+      int i = this->entries[id].heapIndex;
+      this->entries[id].active = false;
+      this->heapSize--;
+      if(i != this->heapSize) {
+        this->swapHeap(i, this->heapSize);
+        this->siftDown(i);
+        this->siftUp(i);
+      }
+      return true;
+    };
+
+    /**
+     * Get the next job that is due
+     * The job is rescheduled at a fixed rate from its previous deadline.
+     * Periods that are missed completely are skipped instead of run in a burst.
+     * Returns the job id or -1 if nothing is due.
+     */
+    int popDue(unsigned long now) {
+      if(this->heapSize == 0) {
+        return -1;
+      }
+      int id = this->heap[0];
+      MyEntry *entry = &this->entries[id];
+      if((long)(now - entry->deadline) < 0) {
+        return -1;
+      }
+      entry->deadline += entry->interval;
+      if((long)(now - entry->deadline) >= 0) {
+        entry->deadline += ((now - entry->deadline) / entry->interval + 1) * entry->interval;
+      }
+      this->siftDown(0);
+      return id;
+    };
+
+    /**
+     * Get the earliest deadline
+     * Returns false if there are no jobs
+     */
+    bool nextDeadline(unsigned long *deadline) {
+      if(this->heapSize == 0) {
+        return false;
+      }
+      *deadline = this->entries[this->heap[0]].deadline;
+      return true;
+    };
+
+    /**
+     * Number of active jobs
+     */
+    int count() {
+      return this->heapSize;
+    };
+
+  private:
+    struct MyEntry {
+      bool          active;
+      unsigned long deadline;
+      unsigned long interval;
+      int           heapIndex;
+    };
+
+    MyEntry entries[N];
+    int heap[N];
+    int heapSize;
+
+    /**
+     * Compare the deadlines of two jobs
+     */
+    bool isBefore(int a, int b) {
+      return (long)(this->entries[a].deadline - this->entries[b].deadline) < 0;
+    };
+
+    /**
+     * Swap two heap positions and keep the back references in sync
+     */
+    void swapHeap(int i, int j) {
+      int tmp = this->heap[i];
+      this->heap[i] = this->heap[j];
+      this->heap[j] = tmp;
+      this->entries[this->heap[i]].heapIndex = i;
+      this->entries[this->heap[j]].heapIndex = j;
+    };
+
+    void siftUp(int i) {
+      while(i > 0) {
+        int parent = (i - 1) / 2;
+        if(!this->isBefore(this->heap[i], this->heap[parent])) break;
+        this->swapHeap(i, parent);
+        i = parent;
+      }
+    };
+
+    void siftDown(int i) {
+      for(;;) {
+        int smallest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if(left < this->heapSize && this->isBefore(this->heap[left], this->heap[smallest])) smallest = left;
+        if(right < this->heapSize && this->isBefore(this->heap[right], this->heap[smallest])) smallest = right;
+        if(smallest == i) break;
+        this->swapHeap(i, smallest);
+        i = smallest;
+      }
+    };
+};
+
+using Scheduler = SchedulerT<MAX_SCHEDULES>;
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef SensorDriver_h
+#define SensorDriver_h
+#include <Arduino.h>
+#include "IOHandler.h"
+
+/*
+ * Interface of a sensor driver
+ * A sample is taken in two steps, so sensors with a conversion time do
+ * not block the loop: startSample() starts the conversion and returns the
+ * ms until readResult() may fetch the values.
+ */
+class SensorDriver {
+  public:
+    virtual bool begin(int pin) = 0;
+    virtual unsigned long startSample() = 0;
+    virtual bool readResult(IOHandler::MyValues *values) = 0;
+    virtual unsigned long minInterval() = 0; // Shortest ms between two samples
+    virtual const char *name() = 0;
+
+  protected:
+    ~SensorDriver() {}
+};
+
+/*
+ * Static storage for N drivers of one type
+ * N comes from PIN_MAP, so the memory used is known at link time and
+ * unused drivers take no space.
+ */
+template <class Driver, int N>
+class SensorPool {
+  public:
+    SensorPool() : used(0) {}
+    SensorDriver *take() {
+      return this->used < N ? &this->drivers[this->used++] : NULL;
+    }
+
+  private:
+    Driver drivers[N];
+    int used;
+};
+
+template <class Driver>
+class SensorPool<Driver, 0> {
+  public:
+    SensorDriver *take() {
+      return NULL;
+    }
+};
+
+#endif
@@ -0,0 +1,61 @@
+/*
+ * SensorRegistry
+ * Driver pools and the pin to driver table
+ *
+ * @author Steinar Thorshaug
+ */
+#include "SensorRegistry.h"
+#include "SensorDriver.h"
+#include "Dht22Driver.h"
+#include "Ds18b20Driver.h"
+#include "Sht31Driver.h"
+#include "PinMap.h"
+#include "Log.h"
+
+static SensorPool<Dht22Driver, pinMapCount(IOHandler::PINCONFIG_DHT22)> dht22Drivers;
+static SensorPool<Ds18b20Driver, pinMapCount(IOHandler::PINCONFIG_DS18B20)> ds18b20Drivers;
+static SensorPool<Sht31Driver, pinMapCount(IOHandler::PINCONFIG_SHT31)> sht31Drivers;
+static SensorDriver *drivers[MAX_PINNUMBER+1];
+
+/**
+ * Take a driver for a pin from its pool and start it
+ * A sensor that does not answer is kept, and is retried on every sample.
+ */
+SensorDriver *sensorRegistryAttach(int pin, IOHandler::PinConfig config) {
+  SensorDriver *driver = NULL;
+  if(pin < 0 || pin > MAX_PINNUMBER) {
+    return NULL;
+  }
+  switch(config) {
+    case IOHandler::PINCONFIG_DHT22:
+      driver = dht22Drivers.take();
+      break;
+    case IOHandler::PINCONFIG_DS18B20:
+      driver = ds18b20Drivers.take();
+      break;
+    case IOHandler::PINCONFIG_SHT31:
+      driver = sht31Drivers.take();
+      break;
+    default:
+      break;
+  }
+  if(!driver) {
+    LOG_ERROR("Pin %d: No sensor driver left for config %d", pin, config);
+    return NULL;
+  }
+  if(!driver->begin(pin)) {
+    LOG_WARN("Pin %d: %s does not answer", pin, driver->name());
+  }
+  drivers[pin] = driver;
+  return driver;
+}
+
+/**
+ * Driver of a pin, NULL if the pin has no sensor
+ */
+SensorDriver *sensorDriver(int pin) {
+  if(pin < 0 || pin > MAX_PINNUMBER) {
+    return NULL;
+  }
+  return drivers[pin];
+}
@@ -0,0 +1,13 @@
+#ifndef SensorRegistry_h
+#define SensorRegistry_h
+#include "IOHandler.h"
+
+class SensorDriver;
+
+/*
+ * Maps pins to sensor drivers
+ * Drivers are taken from static pools sized by PIN_MAP, never from the heap.
+ */
+SensorDriver *sensorRegistryAttach(int pin, IOHandler::PinConfig config);
+SensorDriver *sensorDriver(int pin);
+#endif
@@ -0,0 +1,88 @@
+/*
+ * Sht31Driver
+ * SHT31 single shot measurements over Wire
+ *
+ * @author Steinar Thorshaug
+ */
+#include <Wire.h>
+#include "Sht31Driver.h"
+
+const byte SHT31_MEASURE_HIGH[] = { 0x24, 0x00 }; // Single shot, high repeatability, no clock stretching
+const unsigned long SHT31_MEASURE_TIME = 16;       // ms
+const unsigned long SHT31_MIN_INTERVAL = 500;      // Limits self heating
+
+/**
+ * CRC-8 of a measurement word, polynomial 0x31
+ */
+static byte sht31Crc(const byte *data) {
+  byte crc = 0xFF;
+  for(int i=0; i<2; i++) {
+    crc ^= data[i];
+    for(int bit=0; bit<8; bit++) {
+      crc = crc & 0x80 ? (crc << 1) ^ 0x31 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+/**
+ * Constructor
+ */
+Sht31Driver::Sht31Driver() {
+  this->started = false;
+}
+
+/**
+ * Start the I2C bus and check that the sensor answers
+ */
+bool Sht31Driver::begin(int pin) {
+  Wire.begin(pin, I2C_SCL_PIN);
+  Wire.beginTransmission(SHT31_ADDRESS);
+  return Wire.endTransmission() == 0;
+}
+
+/**
+ * Start a single shot measurement
+ */
+unsigned long Sht31Driver::startSample() {
+  Wire.beginTransmission(SHT31_ADDRESS);
+  Wire.write(SHT31_MEASURE_HIGH, sizeof(SHT31_MEASURE_HIGH));
+  this->started = Wire.endTransmission() == 0;
+  return SHT31_MEASURE_TIME;
+}
+
+/**
+ * Read and check the measurement
+ */
+bool Sht31Driver::readResult(IOHandler::MyValues *values) {
+  byte data[6];
+  if(!this->started || Wire.requestFrom(SHT31_ADDRESS, sizeof(data)) != sizeof(data)) {
+    return false;
+  }
+  for(unsigned int i=0; i<sizeof(data); i++) {
+    data[i] = Wire.read();
+  }
+  if(sht31Crc(&data[0]) != data[2] || sht31Crc(&data[3]) != data[5]) {
+    return false;
+  }
+  long t = (long)data[0] << 8 | data[1];
+  long h = (long)data[3] << 8 | data[4];
+  // T = -45 + 175 * t / 65535 degC, RH = 100 * h / 65535 %
+  IOHandler::addValue(values, IOHandler::VALUE_Temperature, -450 + (1750 * t + 32767) / 65535);
+  IOHandler::addValue(values, IOHandler::VALUE_Humidity, (1000 * h + 32767) / 65535);
+  return true;
+}
+
+/**
+ * Shortest ms between two readings
+ */
+unsigned long Sht31Driver::minInterval() {
+  return SHT31_MIN_INTERVAL;
+}
+
+/**
+ * Sensor name for logging
+ */
+const char *Sht31Driver::name() {
+  return "SHT31";
+}
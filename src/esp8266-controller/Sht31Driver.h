@@ -0,0 +1,23 @@
+#ifndef Sht31Driver_h
+#define Sht31Driver_h
+#include "SensorDriver.h"
+
+/*
+ * SHT31 temperature and humidity sensor on I2C
+ * The map pin is SDA, SCL is I2C_SCL_PIN. A single shot measurement takes
+ * 15 ms, the bus is free in the meantime.
+ */
+class Sht31Driver : public SensorDriver {
+  public:
+    Sht31Driver();
+    bool begin(int pin);
+    unsigned long startSample();
+    bool readResult(IOHandler::MyValues *values);
+    unsigned long minInterval();
+    const char *name();
+
+  private:
+    bool started; // The last measurement command was acknowledged
+};
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef SpscQueue_h
+#define SpscQueue_h
+#include <Arduino.h>
+
+/*
+ * Lock-free single producer, single consumer ring
+ * The producer may be an interrupt handler and the consumer the main loop.
+ * Each index is written by one side only, so no locking is needed.
+ * SIZE must be a power of two. One slot is kept free to tell full from empty.
+ */
+template <typename T, unsigned int SIZE>
+class SpscQueue {
+  public:
+    SpscQueue() {
+      this->head = 0;
+      this->tail = 0;
+    };
+
+    /**
+     * Add an item, called by the producer only
+     * Returns false if the queue is full
+     */
+    bool IRAM_ATTR push(const T &item) {
+      unsigned int head = this->head;
+      unsigned int next = (head + 1) & (SIZE - 1);
+      if(next == this->tail) {
+        return false;
+      }
+      this->items[head] = item;
+      // The item must be stored before the consumer can see it
+      __asm__ __volatile__("" ::: "memory");
+      this->head = next;
+      return true;
+    };
+
+    /**
+     * Remove the oldest item, called by the consumer only
+     * Returns false if the queue is empty
+     */
+    bool pop(T *item) {
+      unsigned int tail = this->tail;
+      if(tail == this->head) {
+        return false;
+      }
+      *item = this->items[tail];
+      __asm__ __volatile__("" ::: "memory");
+      this->tail = (tail + 1) & (SIZE - 1);
+      return true;
+    };
+
+    bool empty() {
+      return this->head == this->tail;
+    };
+
+  private:
+    static_assert((SIZE & (SIZE - 1)) == 0, "SpscQueue size must be a power of two");
+    T items[SIZE];
+    volatile unsigned int head;
+    volatile unsigned int tail;
+};
+
+#endif
@@ -0,0 +1,158 @@
+/*
+ * StatusLed
+ * Plays blink patterns on the status LED from the main loop. Callers only
+ * select a pattern and never wait for it to finish.
+ *
+ * @author Steinar Thorshaug
+ */
+#include "StatusLed.h"
+
+const int LED_QUEUE_SIZE = 4; // One-shot patterns waiting to be played
+const int LED_MAX_STEPS = 10;
+
+/*
+ * Step durations in ms, alternating between on and off starting with on
+ */
+struct LedSteps {
+  byte count;
+  bool repeat;
+  unsigned int ms[LED_MAX_STEPS];
+};
+
+static const LedSteps patterns[LED_PatternCount] = {
+  { 0, false, { 0 } },                                                 // LED_None
+  { 4, false, { 100, 100, 100, 300 } },                                // LED_Ok
+  { 10, false, { 100, 100, 100, 100, 100, 100, 100, 100, 100, 300 } }, // LED_Error
+  { 2, false, { 100, 100 } },                                          // LED_Alive
+  { 2, true, { 250, 250 } },                                           // LED_Offline
+  { 2, true, { 50, 950 } }                                             // LED_Busy
+};
+
+static int ledPin = -1;
+static LedPattern queue[LED_QUEUE_SIZE];
+static int queueHead = 0;
+static int queueCount = 0;
+static LedPattern background = LED_None;
+static LedPattern current = LED_None;
+static byte step = 0;
+static unsigned long stepStarted = 0;
+
+/**
+ * Set the LED for the current step
+ */
+static void writeStep() {
+  if(ledPin < 0) {
+    return;
+  }
+  bool on = current != LED_None && (step & 1) == 0;
+  digitalWrite(ledPin, on ? OUTPUT_HIGH : OUTPUT_LOW);
+}
+
+/**
+ * Start playing a pattern from its first step
+ */
+static void startPattern(LedPattern pattern) {
+  current = pattern;
+  step = 0;
+  stepStarted = millis();
+  writeStep();
+}
+
+/**
+ * Start the next queued pattern, or the background when the queue is empty
+ */
+static void startNext() {
+  if(queueCount > 0) {
+    LedPattern next = queue[queueHead];
+    queueHead = (queueHead + 1) % LED_QUEUE_SIZE;
+    queueCount--;
+    startPattern(next);
+  } else {
+    startPattern(background);
+  }
+}
+
+/**
+ * Take control of the LED pin
+ */
+void statusLedInit(int pin) {
+  ledPin = pin;
+  pinMode(ledPin, OUTPUT);
+  startPattern(LED_None);
+}
+
+/**
+ * Play a one-shot pattern
+ * A playing background pattern is interrupted at once. With LED_Queue the
+ * pattern is dropped if the queue is full.
+ */
+void statusLedShow(LedPattern pattern, LedMode mode) {
+  if(pattern <= LED_None || pattern >= LED_PatternCount || patterns[pattern].repeat) {
+    return;
+  }
+  if(mode == LED_Replace) {
+    queueCount = 0;
+    startPattern(pattern);
+    return;
+  }
+  if(current == LED_None || patterns[current].repeat) {
+    startPattern(pattern);
+    return;
+  }
+  if(queueCount < LED_QUEUE_SIZE) {
+    queue[(queueHead + queueCount) % LED_QUEUE_SIZE] = pattern;
+    queueCount++;
+  }
+}
+
+/**
+ * Select the pattern shown while no one-shot pattern is playing
+ * LED_None turns the LED off.
+ */
+void statusLedBackground(LedPattern pattern) {
+  if(pattern < LED_None || pattern >= LED_PatternCount || pattern == background) {
+    return;
+  }
+  if(pattern != LED_None && !patterns[pattern].repeat) {
+    return;
+  }
+  background = pattern;
+  if(current == LED_None || patterns[current].repeat) {
+    startPattern(background);
+  }
+}
+
+/**
+ * Advance the playing pattern
+ */
+void statusLedLoop() {
+  if(current == LED_None) {
+    return;
+  }
+  unsigned long now = millis();
+  if(now - stepStarted < patterns[current].ms[step]) {
+    return;
+  }
+  step++;
+  stepStarted = now;
+  if(step < patterns[current].count) {
+    writeStep();
+  } else if(patterns[current].repeat && queueCount == 0 && current == background) {
+    step = 0;
+    writeStep();
+  } else {
+    startNext();
+  }
+}
+
+/**
+ * Time until the LED must change
+ */
+unsigned long millisToNextLedEvent() {
+  if(current == LED_None) {
+    return (unsigned long)-1;
+  }
+  unsigned long elapsed = millis() - stepStarted;
+  unsigned int duration = patterns[current].ms[step];
+  return elapsed >= duration ? 0 : duration - elapsed;
+}
@@ -0,0 +1,34 @@
+#ifndef StatusLed_h
+#define StatusLed_h
+#include <Arduino.h>
+#include "myconstants.h"
+
+/*
+ * Status LED patterns
+ * Ok, Error and Alive are played once. Offline and Busy repeat and are
+ * shown as background while no other pattern is playing.
+ */
+enum LedPattern {
+  LED_None,
+  LED_Ok,       // Request handled, two flashes
+  LED_Error,    // Request failed, five flashes
+  LED_Alive,    // Alive message sent, one flash
+  LED_Offline,  // WiFi is down, fast blinking
+  LED_Busy,     // Waiting for the MQTT broker, short blip every second
+  LED_PatternCount
+};
+
+/*
+ * How a new one-shot pattern is added
+ */
+enum LedMode {
+  LED_Queue,    // Play after the patterns already queued
+  LED_Replace   // Drop the queue and start now
+};
+
+void statusLedInit(int pin);
+void statusLedShow(LedPattern pattern, LedMode mode = LED_Queue);
+void statusLedBackground(LedPattern pattern);
+void statusLedLoop();
+unsigned long millisToNextLedEvent();
+#endif
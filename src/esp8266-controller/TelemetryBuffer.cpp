@@ -0,0 +1,160 @@
+/*
+ * TelemetryBuffer
+ * Keeps readings across MQTT and WiFi outages until they can be published
+ *
+ * @author Steinar Thorshaug
+ */
+#include "TelemetryBuffer.h"
+#include "Log.h"
+#ifdef TELEMETRY_SPILL_LITTLEFS
+#include <LittleFS.h>
+
+static const char *SPILL_FILE = "/telemetry.bin";
+const unsigned long SPILL_MAX_READINGS = 1000; // Limits the spill file size
+#endif
+
+/**
+ * Constructor
+ */
+TelemetryBuffer::TelemetryBuffer() {
+  this->head = 0;
+  this->size = 0;
+  this->droppedReadings = 0;
+#ifdef TELEMETRY_SPILL_LITTLEFS
+  this->fsMounted = false;
+  this->spilled = 0;
+  this->spillRead = 0;
+#endif
+}
+
+/**
+ * Prepare the spill file
+ * Readings left from before a restart are discarded, since the RAM part
+ * of the buffer that followed them is lost.
+ */
+void TelemetryBuffer::setup() {
+#ifdef TELEMETRY_SPILL_LITTLEFS
+  this->fsMounted = LittleFS.begin();
+  if(!this->fsMounted) {
+    LOG_ERROR("TelemetryBuffer: Could not mount LittleFS");
+    return;
+  }
+  LittleFS.remove(SPILL_FILE);
+#endif
+}
+
+/**
+ * Add a reading taken at millis() takenAt
+ * When full, the oldest reading is spilled to flash or dropped
+ */
+void TelemetryBuffer::push(unsigned long takenAt, int pin, const IOHandler::MyValues *values) {
+  if(this->size == TELEMETRY_BUFFER_SIZE) {
+#ifdef TELEMETRY_SPILL_LITTLEFS
+    if(!this->spill(&this->ring[this->head])) {
+      this->droppedReadings++;
+    }
+#else
+    this->droppedReadings++;
+#endif
+    this->head = (this->head + 1) % TELEMETRY_BUFFER_SIZE;
+    this->size--;
+  }
+  MyReading *reading = &this->ring[(this->head + this->size) % TELEMETRY_BUFFER_SIZE];
+  reading->takenAt = takenAt;
+  reading->pin = pin;
+  reading->values = *values;
+  this->size++;
+}
+
+/**
+ * Get a buffered reading, 0 is the oldest
+ */
+bool TelemetryBuffer::peek(int index, TelemetryBuffer::MyReading *reading) {
+#ifdef TELEMETRY_SPILL_LITTLEFS
+  unsigned long inFile = this->spilled - this->spillRead;
+  if((unsigned long)index < inFile) {
+    return this->readSpilled(this->spillRead + index, reading);
+  }
+  index -= inFile;
+#endif
+  if(index >= this->size) {
+    return false;
+  }
+  *reading = this->ring[(this->head + index) % TELEMETRY_BUFFER_SIZE];
+  return true;
+}
+
+/**
+ * Remove the oldest readings after they have been published
+ */
+void TelemetryBuffer::pop(int count) {
+#ifdef TELEMETRY_SPILL_LITTLEFS
+  while(count > 0 && this->spillRead < this->spilled) {
+    this->spillRead++;
+    count--;
+  }
+  if(this->spilled > 0 && this->spillRead == this->spilled) {
+    LittleFS.remove(SPILL_FILE);
+    this->spilled = 0;
+    this->spillRead = 0;
+  }
+#endif
+  if(count > this->size) {
+    count = this->size;
+  }
+  this->head = (this->head + count) % TELEMETRY_BUFFER_SIZE;
+  this->size -= count;
+}
+
+/**
+ * Number of buffered readings
+ */
+int TelemetryBuffer::count() {
+#ifdef TELEMETRY_SPILL_LITTLEFS
+  return this->size + (this->spilled - this->spillRead);
+#else
+  return this->size;
+#endif
+}
+
+/**
+ * Number of readings lost because the buffer was full
+ */
+unsigned long TelemetryBuffer::dropped() {
+  return this->droppedReadings;
+}
+
+#ifdef TELEMETRY_SPILL_LITTLEFS
+/**
+ * Append a reading to the spill file
+ */
+bool TelemetryBuffer::spill(const TelemetryBuffer::MyReading *reading) {
+  if(!this->fsMounted || this->spilled >= SPILL_MAX_READINGS) {
+    return false;
+  }
+  File file = LittleFS.open(SPILL_FILE, "a");
+  if(!file) {
+    return false;
+  }
+  bool ok = file.write((const uint8_t*)reading, sizeof(MyReading)) == sizeof(MyReading);
+  file.close();
+  if(ok) {
+    this->spilled++;
+  }
+  return ok;
+}
+
+/**
+ * Read a reading back from the spill file
+ */
+bool TelemetryBuffer::readSpilled(unsigned long index, TelemetryBuffer::MyReading *reading) {
+  File file = LittleFS.open(SPILL_FILE, "r");
+  if(!file) {
+    return false;
+  }
+  bool ok = file.seek(index * sizeof(MyReading), SeekSet) &&
+            file.read((uint8_t*)reading, sizeof(MyReading)) == (int)sizeof(MyReading);
+  file.close();
+  return ok;
+}
+#endif
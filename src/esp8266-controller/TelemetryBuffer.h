@@ -0,0 +1,43 @@
+#ifndef TelemetryBuffer_h
+#define TelemetryBuffer_h
+#include <Arduino.h>
+#include "myconstants.h"
+#include "IOHandler.h"
+
+/*
+ * Store-and-forward buffer for readings that could not be published
+ * A bounded RAM ring. With TELEMETRY_SPILL_LITTLEFS the oldest readings
+ * are moved to a file in flash instead of being dropped when it is full.
+ */
+class TelemetryBuffer {
+  public:
+    struct MyReading {
+      unsigned long       takenAt;  // millis() when the reading was taken
+      int                 pin;
+      IOHandler::MyValues values;
+    };
+
+    TelemetryBuffer();
+    void setup();
+    void push(unsigned long takenAt, int pin, const IOHandler::MyValues *values);
+    bool peek(int index, TelemetryBuffer::MyReading *reading);
+    void pop(int count);
+    int count();
+    unsigned long dropped();
+
+  private:
+    MyReading ring[TELEMETRY_BUFFER_SIZE];
+    int head;
+    int size;
+    unsigned long droppedReadings;
+#ifdef TELEMETRY_SPILL_LITTLEFS
+    bool fsMounted;
+    unsigned long spilled;    // Readings written to the spill file
+    unsigned long spillRead;  // Readings already forwarded from the spill file
+
+    bool spill(const TelemetryBuffer::MyReading *reading);
+    bool readSpilled(unsigned long index, TelemetryBuffer::MyReading *reading);
+#endif
+};
+
+#endif
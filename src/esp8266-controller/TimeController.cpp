@@ -1,31 +1,80 @@
 /*
  * A simple class for keeping the current time
- * Queries a NTP server regulary and keeps track of time since last query
+ * Queries a NTP server regulary. Between queries the time follows a
+ * 64 bit monotonic clock, corrected for drift and slewed towards NTP.
  */
 #include "TimeController.h"
+#include "myconstants.h"
+#include "JsonWriter.h"
+#include "Log.h"
 #include <ESP8266WiFi.h>
 #include <WiFiUdp.h>
+extern "C" {
+#include <lwip/dns.h>
+}
 
 unsigned int localPort = 2390;      // local port to listen for UDP packets
 IPAddress timeServerIP; // time.nist.gov NTP server address
 const char* ntpServerName = "time.nist.gov";
 const int NTP_PACKET_SIZE = 48; // NTP time stamp is in the first 48 bytes of the message
+const unsigned long NTP_MIN_POLL = 64000;       // ms between queries while the clock settles
+const unsigned long NTP_MAX_POLL = 1024000;     // ms between queries once the clock is stable
+const unsigned long NTP_RETRY_DELAY = 2000;     // ms before retrying a failed query
+const unsigned long NTP_RESOLVE_TIMEOUT = 2000; // ms to wait for DNS
+const unsigned long NTP_RESPONSE_TIMEOUT = 1000; // ms to wait for the NTP reply
+const int NTP_MAX_RETRIES = 3;
+const unsigned long NTP_POLL_INTERVAL = 10; // ms between polls while waiting for the network
+const long NTP_STEP_THRESHOLD = 128; // Larger offsets in ms are stepped, smaller are slewed
+const long NTP_STABLE_OFFSET = 20;   // Offsets in ms below this lengthen the poll interval
+const long NTP_SLEW_RATE = 500;      // Largest slew in ppm, 0.5 ms per second
+const long NTP_MAX_DRIFT = 500000;   // Largest drift correction in ppb
+const unsigned long NTP_MIN_DRIFT_INTERVAL = 16000; // Shortest ms between two samples used for drift
+const unsigned long SEVENTY_YEARS = 2208988800UL; // Seconds from 1900 (NTP) to 1970 (Unix)
+static const char *NTP_NOT_OURS = "not an answer to our query"; // Ignored, the query keeps waiting
 
 byte packetBuffer[ NTP_PACKET_SIZE]; //buffer to hold incoming and outgoing packets
 WiFiUDP udp;
 
-/*
- * Wrapper for millis(). Mainly used for wrap after approx 65 secs.
- * Consider to remove at a later stage.
+/**
+ * 64 bit millis() that does not wrap after 49 days
+ * Must be called at least once per wrap, which updateTimeController() does
+ */
+uint64_t getMonotonicMillis() {
+  static uint32_t lastMillis = 0;
+  static uint32_t wraps = 0;
+  uint32_t now = millis();
+  if(now < lastMillis) {
+    wraps++;
+  }
+  lastMillis = now;
+  return ((uint64_t)wraps << 32) | now;
+}
+
+/**
+ * Read a 64 bit NTP timestamp as Unix time in ms
+ */
+static int64_t readNtpTimestamp(const byte *p) {
+  uint32_t seconds = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+  uint32_t fraction = (uint32_t)p[4] << 24 | (uint32_t)p[5] << 16 | (uint32_t)p[6] << 8 | p[7];
+  return ((int64_t)seconds - SEVENTY_YEARS) * 1000 + (((uint64_t)fraction * 1000) >> 32);
+}
+
+/**
+ * Write a 64 bit value in network order
  */
-static unsigned long myMillis() {
-  return (millis() % 65535);
+static void writeUint64(byte *p, uint64_t value) {
+  for(int i=7; i>=0; i--) {
+    p[i] = value & 0xFF;
+    value >>= 8;
+  }
 }
 
 // send an NTP request to the time server at the given address
-static unsigned long sendNTPpacket(IPAddress& address)
+// The transmit timestamp is our own clock. The server echoes it as the
+// originate timestamp, which identifies the answer to this request.
+static void sendNTPpacket(IPAddress& address, uint64_t sentAt)
 {
-  Serial.println("sending NTP packet...");
+  LOG_DEBUG("sending NTP packet...");
   // set all bytes in the buffer to 0
   memset(packetBuffer, 0, NTP_PACKET_SIZE);
   // Initialize values needed to form NTP request
@@ -39,6 +88,7 @@ static unsigned long sendNTPpacket(IPAddress& address)
   packetBuffer[13]  = 0x4E;
   packetBuffer[14]  = 49;
   packetBuffer[15]  = 52;
+  writeUint64(&packetBuffer[40], sentAt);
 
   // all NTP fields have been given values, now
   // you can send a packet requesting a timestamp:
@@ -48,159 +98,327 @@ static unsigned long sendNTPpacket(IPAddress& address)
 }
 
 void printEpoch(unsigned long epoch) {
-  Serial.print("Unix time ");
-  Serial.print(epoch);
-  Serial.print("  ");
-  // print the hour, minute and second:
-  Serial.print("The UTC time is ");       // UTC is the time at Greenwich Meridian (GMT)
-  Serial.print((epoch  % 86400L) / 3600); // print the hour (86400 equals secs per day)
-  Serial.print(':');
-  if ( ((epoch % 3600) / 60) < 10 ) {
-    // In the first 10 minutes of each hour, we'll want a leading '0'
-    Serial.print('0');
-  }
-  Serial.print((epoch  % 3600) / 60); // print the minute (3600 equals secs per minute)
-  Serial.print(':');
-  if ( (epoch % 60) < 10 ) {
-    // In the first 10 seconds of each minute, we'll want a leading '0'
-    Serial.print('0');
-  }
-  Serial.println(epoch % 60); // print the second
+  // UTC is the time at Greenwich Meridian (GMT), 86400 equals secs per day
+  LOG_INFO("Unix time %lu  The UTC time is %lu:%02lu:%02lu", epoch,
+    (epoch % 86400L) / 3600, (epoch % 3600) / 60, epoch % 60);
 }
 
 
 class TimeController {
   private:    
-    long lastQuery;
-    unsigned long lastEpoch;
-    unsigned long millisAtEpoch;
-    unsigned int wrappedMillis;
-    unsigned long lastMillis;
-    char formattedTime[50];
-
-    /** 
-     *  Check if millisecconds have wrapped since last epoch
+    enum NtpState {
+      NTP_Idle,
+      NTP_Resolve,
+      NTP_Send,
+      NTP_Await
+    };
+
+    unsigned long lastQuery;
+    unsigned long nextQueryDelay;
+    unsigned long pollInterval;
+    unsigned long stateStarted;
+    NtpState state;
+    int retries;
+    volatile bool dnsDone;
+    volatile bool dnsFound;
+    uint64_t sentAt;      // Monotonic ms when the query was sent
+    bool synced;
+    /*
+     * The clock model
+     * utc = baseUtc + elapsed + drift correction + slew, where elapsed
+     * is the monotonic time since baseMono. The slew moves the clock
+     * towards slewTarget at NTP_SLEW_RATE, so it never jumps.
      */
-    void checkWrappedMillis(unsigned long now) {
-      if(this->lastEpoch == 0) {
-        return;
+    int64_t baseUtc;
+    uint64_t baseMono;
+    long driftPpb;
+    long slewTarget;
+
+    /**
+     * Part of slewTarget applied after elapsed ms
+     */
+    long appliedSlew(int64_t elapsed) {
+      int64_t slew = elapsed * NTP_SLEW_RATE / 1000000;
+      long target = this->slewTarget < 0 ? -this->slewTarget : this->slewTarget;
+      if(slew > target) {
+        slew = target;
       }
-      if(now < this->lastMillis) {
-        this->wrappedMillis += 1;
-        Serial.print("Wrapped again ");
-        Serial.println(this->wrappedMillis);
+      return this->slewTarget < 0 ? -(long)slew : (long)slew;
+    };
+
+    /**
+     * UTC in ms at a monotonic time
+     */
+    int64_t utcAt(uint64_t mono) {
+      int64_t elapsed = (int64_t)(mono - this->baseMono);
+      return this->baseUtc + elapsed + elapsed * this->driftPpb / 1000000000 + this->appliedSlew(elapsed);
+    };
+
+    /**
+     * Called by lwIP when the NTP server name is resolved
+     */
+    static void dnsFoundCallback(const char * /*name*/, const ip_addr_t *ipaddr, void *arg) {
+      TimeController *self = (TimeController*)arg;
+      if(ipaddr) {
+        timeServerIP = IPAddress(ip_addr_get_ip4_u32(ipaddr));
+        self->dnsFound = true;
       }
-      this->lastMillis = now;
+      self->dnsDone = true;
+    };
+
+    /**
+     * Enter a new state of the NTP exchange
+     */
+    void setState(NtpState state) {
+      this->state = state;
+      this->stateStarted = millis();
     };
 
     /**
-     * Get number of millisecons since last epoch
+     * Give up the current query and schedule a retry
      */
-    int millisSinceEpoch() {
-      unsigned long now = myMillis();  
-      this->checkWrappedMillis(now);
-      return (int)now-(int)this->millisAtEpoch+(int)this->wrappedMillis*65535;
+    void queryFailed(const char *reason) {
+      LOG_WARN("NTP query failed: %s", reason);
+      this->retries++;
+      if(this->retries < NTP_MAX_RETRIES) {
+        this->nextQueryDelay = NTP_RETRY_DELAY;
+      } else {
+        this->retries = 0;
+        this->nextQueryDelay = this->pollInterval;
+      }
+      this->lastQuery = millis();
+      this->setState(NTP_Idle);
     };
+
+    /**
+     * Start resolving the NTP server
+     */
+    void startQuery() {
+      ip_addr_t addr;
+      this->dnsDone = false;
+      this->dnsFound = false;
+      err_t err = dns_gethostbyname(ntpServerName, &addr, &TimeController::dnsFoundCallback, this);
+      if(err == ERR_OK) {
+        // Answered from the DNS cache
+        timeServerIP = IPAddress(ip_addr_get_ip4_u32(&addr));
+        this->setState(NTP_Send);
+      } else if(err == ERR_INPROGRESS) {
+        this->setState(NTP_Resolve);
+      } else {
+        this->queryFailed("DNS lookup not started");
+      }
+    };
+
+    /**
+     * Decode a received NTP packet
+     * Returns NULL on success, else the reason the packet was rejected
+     */
+    const char *parseNtpPacket(int length, uint64_t receivedAt) {
+      if(length < NTP_PACKET_SIZE) {
+        udp.flush();
+        return "short packet";
+      }
+      udp.read(packetBuffer, NTP_PACKET_SIZE); // read the packet into the buffer
+
+      byte originate[8];
+      writeUint64(originate, this->sentAt);
+      if(memcmp(&packetBuffer[24], originate, sizeof(originate)) != 0) {
+        return NTP_NOT_OURS;
+      }
+      if((packetBuffer[0] & 0x07) != 4 || packetBuffer[1] == 0) {
+        return "not a valid server reply";
+      }
+
+      // T1 and T4 are our clock, T2 and T3 the server clock
+      int64_t t1 = this->utcAt(this->sentAt);
+      int64_t t2 = readNtpTimestamp(&packetBuffer[32]);
+      int64_t t3 = readNtpTimestamp(&packetBuffer[40]);
+      int64_t t4 = this->utcAt(receivedAt);
+      // The first offset is the whole time since 1970, too large for a long
+      int64_t offset = ((t2 - t1) + (t3 - t4)) / 2;
+      int64_t delay = (t4 - t1) - (t3 - t2);
+      if(delay < 0) {
+        return "negative round trip";
+      }
+      this->adjust(offset, receivedAt);
+      LOG_DEBUG("NTP delay %ld ms, drift %ld ppb, poll %lu s", (long)delay, this->driftPpb, this->pollInterval / 1000);
+      return NULL;
+    };
+
+    /**
+     * Correct the clock by a measured offset
+     * Small offsets are slewed and feed the drift estimate. Large offsets,
+     * and the first sample, step the clock.
+     */
+    void adjust(int64_t offset, uint64_t now) {
+      int64_t elapsed = (int64_t)(now - this->baseMono);
+      int64_t utc = this->utcAt(now);
+
+      if(!this->synced || offset > NTP_STEP_THRESHOLD || offset < -NTP_STEP_THRESHOLD) {
+        this->baseUtc = utc + offset;
+        this->slewTarget = 0;
+        this->pollInterval = NTP_MIN_POLL;
+        this->synced = true;
+        printEpoch((unsigned long)(this->baseUtc / 1000));
+      } else {
+        LOG_DEBUG("NTP offset %ld ms", (long)offset);
+        if(elapsed >= (int64_t)NTP_MIN_DRIFT_INTERVAL) {
+          // What is left after the pending slew is frequency error
+          long remaining = this->slewTarget - this->appliedSlew(elapsed);
+          long error = (long)((offset - remaining) * 1000000000 / elapsed);
+          this->driftPpb = constrain(this->driftPpb + error / 2, -NTP_MAX_DRIFT, NTP_MAX_DRIFT);
+        }
+        this->baseUtc = utc;
+        this->slewTarget = (long)offset;
+        if(offset < NTP_STABLE_OFFSET && offset > -NTP_STABLE_OFFSET) {
+          this->pollInterval = min(this->pollInterval * 2, NTP_MAX_POLL);
+        } else {
+          this->pollInterval = NTP_MIN_POLL;
+        }
+      }
+      this->baseMono = now;
+    };
+
   public:
     /**
      * Create a timecontroller object
      */
     TimeController() {
-      this->wrappedMillis = 0;
       this->lastQuery = 0;
-      this->millisAtEpoch = 0;
-      this->lastEpoch = 0;
-      this->lastMillis = 0;
+      this->nextQueryDelay = 0;
+      this->pollInterval = NTP_MIN_POLL;
+      this->stateStarted = 0;
+      this->state = NTP_Idle;
+      this->retries = 0;
+      this->dnsDone = false;
+      this->dnsFound = false;
+      this->sentAt = 0;
+      this->synced = false;
+      this->baseUtc = 0;
+      this->baseMono = 0;
+      this->driftPpb = 0;
+      this->slewTarget = 0;
     };
     
     void setup() {
-      Serial.println("Starting UDP for NTP communication");
+      LOG_INFO("Starting UDP for NTP communication");
       udp.begin(localPort);
-      Serial.print("Local port: ");
-      Serial.println(udp.localPort());
+      LOG_INFO("Local port: %u", udp.localPort());
     };
 
     /**
-     * Check if time to request current UTC time
+     * Move the NTP exchange one step forward
+     * Never waits for the network. Each phase has its own timeout.
      */
     void loop() {
       unsigned long now = millis();
-      if (abs(now - this->lastQuery) > 60000 || this->lastQuery == 0) {
-        this->lastQuery = now;
-        this->queryNtpTime();
+      const char *error;
+      int cb;
+      switch(this->state) {
+        case NTP_Idle:
+          if(now - this->lastQuery >= this->nextQueryDelay) {
+            this->lastQuery = now;
+            this->startQuery();
+          }
+          break;
+        case NTP_Resolve:
+          if(this->dnsDone) {
+            if(this->dnsFound) {
+              this->setState(NTP_Send);
+            } else {
+              this->queryFailed("unknown host");
+            }
+          } else if(now - this->stateStarted >= NTP_RESOLVE_TIMEOUT) {
+            this->queryFailed("DNS timeout");
+          }
+          break;
+        case NTP_Send:
+          udp.flush();
+          this->sentAt = getMonotonicMillis();
+          sendNTPpacket(timeServerIP, this->sentAt); // send an NTP packet to a time server
+          this->setState(NTP_Await);
+          break;
+        case NTP_Await:
+          cb = udp.parsePacket();
+          if(cb) {
+            LOG_DEBUG("NTP packet received, length=%d", cb);
+            error = this->parseNtpPacket(cb, getMonotonicMillis());
+            if(!error) {
+              this->retries = 0;
+              this->nextQueryDelay = this->pollInterval;
+              this->setState(NTP_Idle);
+            } else if(error == NTP_NOT_OURS) {
+              // A late answer to an earlier query, or not from the server
+              LOG_DEBUG("NTP packet ignored: %s", error);
+            } else {
+              this->queryFailed(error);
+            }
+          } else if(now - this->stateStarted >= NTP_RESPONSE_TIMEOUT) {
+            this->queryFailed("no response");
+          }
+          break;
       }
-      
-      this->checkWrappedMillis(myMillis());
     };
 
     /**
-     * Update current UTC time
+     * Milliseconds until loop() has something to do
      */
-    void queryNtpTime() {
-      int counter = 0;
-      //get a random server from the pool
-      WiFi.hostByName(ntpServerName, timeServerIP); 
-      udp.flush();
-      sendNTPpacket(timeServerIP); // send an NTP packet to a time server
-      // wait to see if a reply is available  
-      int cb = 0;
-      Serial.print("Wait for response");
-      while(counter < 10) {
-        counter++;
-        cb = udp.parsePacket();
-        if(!cb) {
-          Serial.print(".");
-          delay(100);
-        } else {
-          counter = 100;
-        }
+    unsigned long millisToNextEvent() {
+      unsigned long elapsed;
+      switch(this->state) {
+        case NTP_Idle:
+          elapsed = millis() - this->lastQuery;
+          return elapsed >= this->nextQueryDelay ? 0 : this->nextQueryDelay - elapsed;
+        case NTP_Send:
+          return 0;
+        default:
+          return NTP_POLL_INTERVAL;
       }
-      
-      if (!cb) {
-        Serial.println("no packet yet");
+    };
+
+    /**
+     * UTC time in ms and the drift estimate, for restoring after a reboot
+     * Returns false if the clock has not been synced
+     */
+    bool snapshot(int64_t *utcMillis, long *driftPpb) {
+      *driftPpb = this->driftPpb;
+      if(!this->synced) {
+        return false;
       }
-      else {
-        Serial.print(" packet received, length=");
-        Serial.println(cb);
-        // We've received a packet, read the data from it
-        udp.read(packetBuffer, NTP_PACKET_SIZE); // read the packet into the buffer
-    
-        //the timestamp starts at byte 40 of the received packet and is four bytes,
-        // or two words, long. First, esxtract the two words:
-    
-        unsigned long highWord = word(packetBuffer[40], packetBuffer[41]);
-        unsigned long lowWord = word(packetBuffer[42], packetBuffer[43]);
-        // combine the four bytes (two words) into a long integer
-        // this is NTP time (seconds since Jan 1 1900):
-        unsigned long secsSince1900 = highWord << 16 | lowWord;    
-        // now convert NTP time into everyday time:
-        // Unix time starts on Jan 1 1970. In seconds, that's 2208988800:
-        const unsigned long seventyYears = 2208988800UL;
-        // subtract seventy years:
-        unsigned long epoch = secsSince1900 - seventyYears;
-        printEpoch(epoch);
-    
-        this->lastEpoch = epoch;
-        this->millisAtEpoch = myMillis();
-        this->wrappedMillis = 0;    
+      *utcMillis = this->utcAt(getMonotonicMillis());
+      return true;
+    };
+
+    /**
+     * Continue from a saved clock until the next NTP reply
+     * With utcMillis 0 only the drift estimate is restored.
+     */
+    void restore(int64_t utcMillis, long driftPpb) {
+      this->driftPpb = constrain(driftPpb, -NTP_MAX_DRIFT, NTP_MAX_DRIFT);
+      if(utcMillis <= 0) {
+        return;
       }
+      this->baseUtc = utcMillis;
+      this->baseMono = getMonotonicMillis();
+      this->slewTarget = 0;
+      this->synced = true;
+      printEpoch((unsigned long)(utcMillis / 1000));
     };
 
     /**
-     * Get current epoch
+     * Get current UTC time in ms, 0 until the first NTP reply
      */
-    unsigned long currentEpoch() {
-      if(this->lastEpoch == 0) {
+    uint64_t currentUtcMillis() {
+      if(!this->synced) {
         return 0;
       }
-      return (unsigned long)(this->lastEpoch+this->millisSinceEpoch()/1000);
+      return (uint64_t)this->utcAt(getMonotonicMillis());
     };
     
 };
 
 
 static TimeController *timecontroller = NULL;
-static char timeString[50];
 
 /**
  * Init timecontroller
@@ -214,31 +432,76 @@ void initTimeController(bool useNtp) {
 
 /**
  * Update timecontroller
- * Check for wrapped milliseconds and query NTP if necessary
+ * Keep the monotonic clock up to date and query NTP if necessary
  */
 bool updateTimeController() {
+  getMonotonicMillis();
   if(!timecontroller) return false;
   timecontroller->loop();
+  return true;
+}
+
+/**
+ * Milliseconds until updateTimeController() has something to do
+ */
+unsigned long millisToNextTimeEvent() {
+  if(!timecontroller) return (unsigned long)-1;
+  return timecontroller->millisToNextEvent();
 }
 
 /**
  * Get current UTC time
  */
 unsigned long getCurrentUtcTime() {
+  return (unsigned long)(getCurrentUtcMillis() / 1000);
+}
+
+/**
+ * Get current UTC time in ms
+ */
+uint64_t getCurrentUtcMillis() {
   if(!timecontroller) return 0;
-  return timecontroller->currentEpoch();
+  return timecontroller->currentUtcMillis();
 }
 
 /**
- * Format current UTC time as a JSON field with comma at the end
+ * True when published times are valid
+ * Also true without the time controller, since no time is published then
  */
-char* getCurrentUtcTimeAsJsonField() {
-  if(!timecontroller) {
-    timeString[0] = 0;
-    return timeString;
+bool utcTimeReady() {
+  if(!timecontroller) return true;
+  return timecontroller->currentUtcMillis() != 0;
+}
+
+/**
+ * Add the UTC time ageMillis ago as a "time" field, and "tms" in ms if enabled
+ * Nothing is added when the time controller is not in use
+ */
+void writeUtcTimeField(JsonWriter *json, unsigned long ageMillis) {
+  if(!timecontroller) return;
+  uint64_t now = timecontroller->currentUtcMillis();
+  if(now > ageMillis) {
+    now -= ageMillis;
   }
-  snprintf(timeString, 50, "\"time\":%ld,", timecontroller->currentEpoch());
-  return timeString;
-  return timeString;
+  json->addUnsigned("time", (unsigned long)(now / 1000));
+#ifdef UTC_TIME_MILLIS
+  json->addUnsigned64("tms", now);
+#endif
 }
 
+/**
+ * Get the UTC time in ms and the drift estimate
+ * Returns false if the time is not known
+ */
+bool getTimeSnapshot(int64_t *utcMillis, long *driftPpb) {
+  if(!timecontroller) return false;
+  return timecontroller->snapshot(utcMillis, driftPpb);
+}
+
+/**
+ * Set the clock from a saved snapshot, until NTP answers
+ */
+void restoreTimeSnapshot(int64_t utcMillis, long driftPpb) {
+  if(!timecontroller) return;
+  timecontroller->restore(utcMillis, driftPpb);
+}
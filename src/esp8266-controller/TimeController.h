@@ -1,7 +1,15 @@
 #ifndef TimeController_h
 #define TimeController_h
+#include <stdint.h>
+class JsonWriter;
 void initTimeController(bool useNtp);
 bool updateTimeController();
+unsigned long millisToNextTimeEvent();
+uint64_t getMonotonicMillis();
 unsigned long getCurrentUtcTime();
-char* getCurrentUtcTimeAsJsonField();
+uint64_t getCurrentUtcMillis();
+bool utcTimeReady();
+void writeUtcTimeField(JsonWriter *json, unsigned long ageMillis = 0);
+bool getTimeSnapshot(int64_t *utcMillis, long *driftPpb);
+void restoreTimeSnapshot(int64_t utcMillis, long driftPpb);
 #endif
@@ -9,7 +9,12 @@
 #include "myconstants.h"
 #include "TimeController.h"
 #include "MessageHandler.h"
+#include "ConnectionManager.h"
+#include "FastBoot.h"
 #include "IOHandler.h"
+#include "Log.h"
+#include "StatusLed.h"
+#include "Metrics.h"
 
 /*
  * Parameters to change
@@ -22,6 +27,13 @@ const char* MQTT_TOPIC_STATUS_BASE = "topic_to_use_as_base";
 const char* MQTT_TOPIC_SUBSCRIBE = "topic_to_use/control";
 
 const bool USE_NTP = true; // Set to false to not sync to UTC time
+const bool USE_LIGHT_SLEEP = false; // Set to true to let the WiFi modem light-sleep while idle
+
+/*
+ * Main loop idle handling
+ */
+const unsigned long MAX_IDLE_TIME = 1000; // Longest time between two loop iterations
+const unsigned long IDLE_POLL_INTERVAL = 10; // How often the socket is checked while idle
 
 /*
  * Our framework
@@ -30,26 +42,32 @@ WiFiClient wifiClient;
 PubSubClient mqttClient(wifiClient);
 IOHandler ioHandler;
 MessageHandler messageHandler(&mqttClient, MQTT_TOPIC_STATUS_BASE, &ioHandler);
+ConnectionManager connection(&mqttClient, MQTT_TOPIC_SUBSCRIBE);
 
 
 /**
- * Configure all input and outputs prior to calling messagehandler.setup()
+ * Configure scheduled requests prior to calling messagehandler.setup()
+ * Pin roles are declared in PIN_MAP in myconstants.h
  */
-void configurePinIO() {
-  // An example of adding a digital out pin
-  ioHandler.assignPinConfiguration(4, IOHandler::PINCONFIG_DO);
-  
-  // An example on adding a DHT22 sensor
-#ifdef EXTLIB_DHT22
-  ioHandler.assignPinConfiguration(0, IOHandler::PINCONFIG_DHT22);
-  
-  // Scheduled requests example
-  MessageHandler::MyRequest request1;
-  request1.req = MessageHandler::MyRequestType::REQ_ReadValues;
-  request1.pin = 0;
-  request1.waittime = 0;
-  messageHandler.addScheduledRequest(&request1, 60000);
-#endif
+void configureSchedules() {
+  // An example on reading a DHT22 sensor on pin 0 every minute
+  if(IOHandler::pinConfig(0) == IOHandler::PINCONFIG_DHT22) {
+    MessageHandler::MyRequest request1;
+    request1.req = MessageHandler::MyRequestType::REQ_ReadValues;
+    request1.pin = 0;
+    request1.waittime = 0;
+    request1.encoding = MessageHandler::ENCODING_Text;
+    request1.argCount = 0;
+    messageHandler.addScheduledRequest(&request1, 60000);
+
+    // Only publish changes of more than 0.5 degC or 0.5 %RH, and at least every 15 minutes
+    MessageHandler::MyReportPolicy policy1;
+    policy1.deadband = 5;
+    policy1.deadbandPercent = 0;
+    policy1.minInterval = 0;
+    policy1.maxInterval = 900000;
+    messageHandler.setReportPolicy(0, &policy1);
+  }
 }
 
 /*
@@ -59,47 +77,31 @@ void mqttDataCallback(char* topic, byte* payload, unsigned int length) {
   messageHandler.handleRequest(topic, payload, length);
 }
 
-/*
- * Assert that we are connected to the MQTT broker
+/**
+ * Wait until the next module deadline, until data arrives on the socket
+ * or until an input changes
  */
-void mqttReconnect() {
-  // Loop until we're reconnected
-  while (!mqttClient.connected()) {
-    Serial.print("Attempting MQTT connection...");
-    String clientId = String("ESP8266 ");
-    clientId.concat(String(ESP.getChipId()));
-    // Attempt to connect
-    if (mqttClient.connect(clientId.c_str())) {
-      Serial.println("connected");      
-      mqttClient.subscribe(MQTT_TOPIC_SUBSCRIBE);
-    } else {
-      Serial.print("failed, rc=");
-      Serial.print(mqttClient.state());
-      Serial.println(" try again in 5 seconds");
-      // Flash onboard LED
-      ioHandler.flashLed(STATUSLED, 3, 200);
-      delay(4000);
-    }
+static void idleUntilNextEvent() {
+  unsigned long wait = MAX_IDLE_TIME;
+  wait = min(wait, connection.millisToNextEvent());
+  wait = min(wait, millisToNextFastBootEvent());
+  wait = min(wait, millisToNextTimeEvent());
+  wait = min(wait, ioHandler.millisToNextEvent());
+  wait = min(wait, messageHandler.millisToNextEvent());
+  wait = min(wait, millisToNextLogEvent());
+  wait = min(wait, millisToNextLedEvent());
+  if(wait == 0) {
+    yield();
+    return;
   }
-}
 
-/**
- * Check that WIFI is connected
- * If not connected, wait untill connected
- */
-static void wifiReconnect() {
-  if(WiFi.status() == WL_CONNECTED) return;
-  while (WiFi.status() != WL_CONNECTED) {
-    digitalWrite(STATUSLED, OUTPUT_HIGH);
-    delay(250);
-    digitalWrite(STATUSLED, OUTPUT_LOW);
-    delay(250);
-    Serial.print(".");
+  unsigned long start = millis();
+  while(millis() - start < wait) {
+    if(wifiClient.available() || ioHandler.eventPending()) {
+      break;
+    }
+    delay(min(IDLE_POLL_INTERVAL, wait - (millis() - start)));
   }
-  Serial.println("");
-  Serial.println("WiFi connected");
-  Serial.print("My ip is ");
-  Serial.println(WiFi.localIP());
 }
 
 
@@ -107,42 +109,64 @@ static void wifiReconnect() {
  * Setup application
  */
 void setup() {
+  fastBootLoad();
   Serial.begin(115200);
   delay(10);
+#ifdef ENABLE_METRICS
+  metricsInit();
+#endif
 
-  pinMode(STATUSLED, OUTPUT);
-  digitalWrite(STATUSLED, OUTPUT_LOW);
+  statusLedInit(STATUSLED);
 
   // Connect to WiFi network
-  Serial.println();
-  Serial.print("Chip ID ");
-  Serial.println(ESP.getChipId());
-  Serial.println();
-  Serial.print("Connecting to ");
-  Serial.println(NETWORK_SSID);
+  LOG_INFO("Chip ID %lu", (unsigned long)ESP.getChipId());
+  configureSchedules();
+  ioHandler.setup();
+  messageHandler.setup();
+
+  LOG_INFO("Connecting to %s", NETWORK_SSID);
   
-  WiFi.begin(NETWORK_SSID, NETWORK_PASSWORD);  
-  wifiReconnect();
-  Serial.println("");
-  Serial.println("Start MQTT");
+  if(USE_LIGHT_SLEEP) {
+    WiFi.setSleepMode(WIFI_LIGHT_SLEEP);
+  }
+  fastBootBegin(NETWORK_SSID, NETWORK_PASSWORD);
+  wifiClient.setTimeout(2000); // Bounds the TCP connect in each MQTT attempt
   mqttClient.setServer(MQTT_SERVER, 1883);
   mqttClient.setCallback(mqttDataCallback);
+  logSetMqtt(&mqttClient, MQTT_TOPIC_STATUS_BASE);
+  connection.setup();
   initTimeController(USE_NTP);
-  configurePinIO();
-  ioHandler.setup();
+  fastBootRestoreTime();
 }
 
 /**
  * Main loop
  */
 void loop() {
-  wifiReconnect();
-  if (!mqttClient.connected()) {
-    mqttReconnect();
+  METRICS_LOOP_START();
+  bool online = connection.loop();
+  fastBootLoop(connection.wifiConnected(), online);
+  if(online) {
+    METRICS_SECTION(METRIC_MqttLoop);
+    mqttClient.loop();
+  }
+  if(connection.wifiConnected()) {
+    METRICS_SECTION(METRIC_TimeController);
+    updateTimeController();
+  }
+  ioHandler.loop();
+  {
+    METRICS_SECTION(METRIC_MessageHandler);
+    // While offline, sampling continues and values are buffered
+    if(online) {
+      messageHandler.loop();
+    } else {
+      messageHandler.sampleLoop();
+    }
   }
-  mqttClient.loop();
-  updateTimeController();
-  messageHandler.loop();
-  delay(100); 
+  statusLedLoop();
+  logLoop();
+  METRICS_LOOP_END();
+  idleUntilNextEvent();
 }
 
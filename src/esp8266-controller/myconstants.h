@@ -12,6 +12,46 @@
  * Uncomment the wanted dependencies
  */
 //#define EXTLIB_DHT22 // Requires "Adafruit DHT22" and "Adafruit Unified Sensor"
+//#define EXTLIB_ONEWIRE // Requires "OneWire", for DS18B20
+//#define TELEMETRY_SPILL_LITTLEFS // Spill buffered readings to flash when the RAM buffer is full
+//#define FASTBOOT_FLASH // Keep the last network in flash too, for fast reconnects after a power loss
+
+/*
+ * Logging
+ * LOG_LEVEL: 0=none, 1=error, 2=warning, 3=info, 4=debug
+ * Messages above the level are removed at compile time.
+ * Uncomment LOG_TO_MQTT to also publish batched log lines to <base>/log
+ */
+#define LOG_LEVEL 3
+//#define LOG_TO_MQTT
+
+/*
+ * Instrumentation
+ * Uncomment ENABLE_METRICS to publish loop timing and counters to <base>/metrics
+ * Requires MQTT_MAX_PACKET_SIZE of at least 512, the build stops if it is smaller
+ */
+//#define ENABLE_METRICS
+
+/*
+ * Pin roles
+ * One X(pin, config) per used pin, checked at compile time. Examples:
+ *   X(5, PINCONFIG_DI)    digital input, e.g. a door contact
+ *   X(3, PINCONFIG_AI)    the analog input A0, reported as pin 3
+ *   X(5, PINCONFIG_AO)    PWM output, e.g. a dimmer
+ *   X(0, PINCONFIG_DHT22) DHT22 sensor, requires EXTLIB_DHT22
+ *   X(0, PINCONFIG_DS18B20) DS18B20 sensor, requires EXTLIB_ONEWIRE
+ *   X(4, PINCONFIG_SHT31) SHT31 sensor, the pin is SDA and I2C_SCL_PIN is SCL
+ * Drivers for configurations that are not used are left out of the binary.
+ */
+#define PIN_MAP(X) \
+  X(4, PINCONFIG_DO)
+
+/*
+ * Timestamps
+ * Uncomment UTC_TIME_MILLIS to add a "tms" field with the UTC time in ms
+ * next to "time" in published messages
+ */
+//#define UTC_TIME_MILLIS
 
 // The outputs are reversed on my ESP8266
 const int OUTPUT_HIGH = LOW;
@@ -20,5 +60,26 @@ const int OUTPUT_LOW = HIGH;
 // Handy constants
 const int STATUSLED = BUILTIN_LED;
 const int MAX_PINNUMBER=7; // Largest allowed pinnumber
+const int MAX_SCHEDULES=10; // Number of scheduled requests
+const int REQUEST_QUEUE_SIZE=8; // Received requests waiting to be run
+const unsigned long REQUEST_TIME_BUDGET=10000; // us per loop spent running queued requests
+const int MAX_BATCH_REQUESTS=8; // Most requests in one batch message
+const int MAX_VALUES=8; // Largest number of values from one reading
+const int MAX_TOPIC_LENGTH=48; // Longest MQTT topic including the base topic
+const unsigned long SAMPLE_INTERVAL=2000; // ms between background sensor readings (raised to the minimum of the sensor)
+const int I2C_SCL_PIN=5; // I2C clock, used by PINCONFIG_SHT31
+const uint8_t SHT31_ADDRESS=0x44; // I2C address of the SHT31, 0x45 with ADDR high
+const unsigned long SAMPLE_MAX_AGE=5000; // Default max age in ms of a cached sample for ReadValues
+const unsigned long DI_DEBOUNCE_TIME=10000; // us after an accepted input edge where further edges are ignored
+const int DI_QUEUE_SIZE=32; // Input edges waiting for the main loop, must be a power of two
+const unsigned long AI_SAMPLE_INTERVAL=10; // ms between analog samples
+const int AI_FILTER_SHIFT=3; // IIR low pass of analog samples, each sample weighs 1/2^AI_FILTER_SHIFT
+const int AI_WINDOW_SIZE=1000; // Analog samples aggregated into one published window
+const unsigned long AO_PWM_FREQUENCY=1000; // Hz, shared by all PWM outputs
+const int AO_PWM_RANGE=1023; // PWM duty cycle steps, the output resolution
+const unsigned long AO_UPDATE_INTERVAL=20; // ms between output updates while fading
+const int AO_MAX_STEPS=8; // Steps in one output sequence
+const int MAX_REQUEST_ARGS=1+2*AO_MAX_STEPS; // Fields after the wait time in one request
+const int TELEMETRY_BUFFER_SIZE=32; // Readings kept in RAM while MQTT is down
 
 #endif